@@ -1,13 +1,27 @@
+#define _DEFAULT_SOURCE
+
 #include "sqlite3.h"
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define NIB_X86 1
+#endif
+
 static void die(const char *message) {
   perror(message);
   exit(1);
@@ -15,512 +29,5789 @@ static void die(const char *message) {
 
 #define UNUSED(x) (void)(x)
 
-struct Buffer {
-  char *memory;
-  int length;
-  int capacity;
-};
-
-static void buffer_init(struct Buffer *buffer) {
-  const int initial_buffer_size = 4 * 1024;
-  buffer->memory = malloc(initial_buffer_size);
-  buffer->length = 0;
-  buffer->capacity = initial_buffer_size;
+// Milliseconds on a clock that only goes forward.
+static int64_t clock_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
 }
 
-static void buffer_free(struct Buffer *buffer) {
-  free(buffer->memory);
-  buffer->memory = NULL;
-  buffer->capacity = 0;
-  buffer->length = 0;
+// The same clock in microseconds, for timing things that take less than a
+// millisecond.
+static int64_t clock_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
 
-static void buffer_insert(struct Buffer *buffer, int position, const char *data,
-                          int length) {
-  if (position < 0 || length < 0) {
-    die("negative position or length");
-  }
-
-  // Ensure we have enough space in the buffer.
-  if (buffer->length + length > buffer->capacity) {
-    int new_capacity = buffer->capacity * 2;
-    buffer->memory = realloc(buffer->memory, sizeof(new_capacity));
-    buffer->capacity = new_capacity;
+// Find the first occurrence of c in the data, returning its index or -1.
+// This sits under everything that looks for newlines, so on x86 there are
+// SSE2 and AVX2 versions, chosen the first time it's called.
+static int64_t text_find_byte_scalar(const char *data, int64_t length,
+                                     char c) {
+  for (int64_t i = 0; i < length; i++) {
+    if (data[i] == c) {
+      return i;
+    }
   }
+  return -1;
+}
 
-  // Make a hole, if we need to.
-  if (position < buffer->length) {
-    memmove(buffer->memory + position + length, buffer->memory + position,
-            buffer->length - position);
+#ifdef NIB_X86
+static int64_t text_find_byte_sse2(const char *data, int64_t length, char c) {
+  const __m128i needle = _mm_set1_epi8(c);
+  int64_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(const void *)(data + i));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
   }
-
-  // Copy into the hole.
-  memcpy(buffer->memory + position, data, length);
-  buffer->length += length;
+  int64_t found = text_find_byte_scalar(data + i, length - i, c);
+  return found < 0 ? -1 : i + found;
 }
 
-static void buffer_append(struct Buffer *buffer, const char *data, int length) {
-  buffer_insert(buffer, buffer->length, data, length);
+__attribute__((target("avx2"))) static int64_t
+text_find_byte_avx2(const char *data, int64_t length, char c) {
+  const __m256i needle = _mm256_set1_epi8(c);
+  int64_t i = 0;
+  for (; i + 64 <= length; i += 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(const void *)(data + i));
+    __m256i b =
+        _mm256_loadu_si256((const __m256i *)(const void *)(data + i + 32));
+    __m256i hits_a = _mm256_cmpeq_epi8(a, needle);
+    __m256i hits_b = _mm256_cmpeq_epi8(b, needle);
+    if (_mm256_movemask_epi8(_mm256_or_si256(hits_a, hits_b))) {
+      unsigned mask_a = (unsigned)_mm256_movemask_epi8(hits_a);
+      if (mask_a) {
+        return i + __builtin_ctz(mask_a);
+      }
+      unsigned mask_b = (unsigned)_mm256_movemask_epi8(hits_b);
+      return i + 32 + __builtin_ctz(mask_b);
+    }
+  }
+  int64_t found = text_find_byte_sse2(data + i, length - i, c);
+  return found < 0 ? -1 : i + found;
 }
+#endif
 
-static void buffer_append_int(struct Buffer *buffer, int value) {
-  char txt[21]; // -9,223,372,036,854,775,807
+static int64_t text_find_byte_select(const char *data, int64_t length,
+                                     char c);
 
-  char *end = txt + 21;
-  char *cursor = end;
+static int64_t (*text_find_byte)(const char *, int64_t,
+                                 char) = text_find_byte_select;
 
-  int neg = 0;
-  if (value < 0) {
-    neg = 1;
-    value = -value;
+static int64_t text_find_byte_select(const char *data, int64_t length,
+                                     char c) {
+#ifdef NIB_X86
+  if (__builtin_cpu_supports("avx2")) {
+    text_find_byte = text_find_byte_avx2;
+  } else {
+    text_find_byte = text_find_byte_sse2;
   }
+#else
+  text_find_byte = text_find_byte_scalar;
+#endif
+  return text_find_byte(data, length, c);
+}
 
-  while (value) {
-    cursor -= 1;
-    *cursor = (value % 10) + '0';
-    value /= 10;
+// Find the last occurrence of c in the data, the same way but from the end.
+static int64_t text_rfind_byte_scalar(const char *data, int64_t length,
+                                      char c) {
+  for (int64_t i = length - 1; i >= 0; i--) {
+    if (data[i] == c) {
+      return i;
+    }
   }
+  return -1;
+}
 
-  if (neg) {
-    cursor -= 1;
-    *cursor = '-';
+#ifdef NIB_X86
+static int64_t text_rfind_byte_sse2(const char *data, int64_t length,
+                                    char c) {
+  const __m128i needle = _mm_set1_epi8(c);
+  int64_t i = length;
+  while (i >= 16) {
+    i -= 16;
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(const void *)(data + i));
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+    if (mask) {
+      return i + 31 - __builtin_clz(mask);
+    }
   }
+  return text_rfind_byte_scalar(data, i, c);
+}
 
-  buffer_append(buffer, cursor, end - cursor);
+__attribute__((target("avx2"))) static int64_t
+text_rfind_byte_avx2(const char *data, int64_t length, char c) {
+  const __m256i needle = _mm256_set1_epi8(c);
+  int64_t i = length;
+  while (i >= 64) {
+    i -= 64;
+    __m256i a = _mm256_loadu_si256((const __m256i *)(const void *)(data + i));
+    __m256i b =
+        _mm256_loadu_si256((const __m256i *)(const void *)(data + i + 32));
+    __m256i hits_a = _mm256_cmpeq_epi8(a, needle);
+    __m256i hits_b = _mm256_cmpeq_epi8(b, needle);
+    if (_mm256_movemask_epi8(_mm256_or_si256(hits_a, hits_b))) {
+      unsigned mask_b = (unsigned)_mm256_movemask_epi8(hits_b);
+      if (mask_b) {
+        return i + 32 + 31 - __builtin_clz(mask_b);
+      }
+      unsigned mask_a = (unsigned)_mm256_movemask_epi8(hits_a);
+      return i + 31 - __builtin_clz(mask_a);
+    }
+  }
+  return text_rfind_byte_sse2(data, i, c);
 }
+#endif
 
-static void buffer_clear(struct Buffer *buffer) { buffer->length = 0; }
+static int64_t text_rfind_byte_select(const char *data, int64_t length,
+                                      char c);
+
+static int64_t (*text_rfind_byte)(const char *, int64_t,
+                                  char) = text_rfind_byte_select;
 
-static void buffer_erase(struct Buffer *buffer, int position) {
-  if (position < buffer->length && position >= 0) {
-    memmove(buffer->memory + position, buffer->memory + position + 1,
-            buffer->length - position);
-    buffer->length -= 1;
+static int64_t text_rfind_byte_select(const char *data, int64_t length,
+                                      char c) {
+#ifdef NIB_X86
+  if (__builtin_cpu_supports("avx2")) {
+    text_rfind_byte = text_rfind_byte_avx2;
+  } else {
+    text_rfind_byte = text_rfind_byte_sse2;
   }
+#else
+  text_rfind_byte = text_rfind_byte_scalar;
+#endif
+  return text_rfind_byte(data, length, c);
 }
 
-static int buffer_find(struct Buffer *buffer, char c, int start) {
-  if (start < 0) {
-    start = 0;
+// Find the first occurrence of a string in the data, returning its index or
+// -1. Horspool's skip table lets the scalar version step over most of the
+// text. The vector versions look for blocks where both the first and the
+// last byte of the needle line up, and only compare the middle at those
+// spots, which are rare in real text.
+static int64_t text_find_scalar(const char *data, int64_t length,
+                                const char *needle, int64_t needle_length) {
+  if (needle_length == 0) {
+    return 0;
+  }
+  if (needle_length > length) {
+    return -1;
+  }
+
+  int64_t skip[256];
+  for (int i = 0; i < 256; i++) {
+    skip[i] = needle_length;
   }
-  while (start < buffer->length) {
-    if (buffer->memory[start] == c) {
-      return start;
+  for (int64_t i = 0; i < needle_length - 1; i++) {
+    skip[(unsigned char)needle[i]] = needle_length - 1 - i;
+  }
+
+  char last = needle[needle_length - 1];
+  int64_t i = 0;
+  while (i + needle_length <= length) {
+    char c = data[i + needle_length - 1];
+    if (c == last && memcmp(data + i, needle, needle_length - 1) == 0) {
+      return i;
     }
-    start += 1;
+    i += skip[(unsigned char)c];
   }
   return -1;
 }
 
-static int buffer_rfind(struct Buffer *buffer, char c, int start) {
-  if (start >= buffer->length) {
-    start = buffer->length - 1;
+#ifdef NIB_X86
+static int64_t text_find_sse2(const char *data, int64_t length,
+                              const char *needle, int64_t needle_length) {
+  if (needle_length < 2) {
+    return needle_length ? text_find_byte_sse2(data, length, needle[0]) : 0;
   }
-  while (start >= 0) {
-    if (buffer->memory[start] == c) {
-      return start;
+
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[needle_length - 1]);
+  int64_t i = 0;
+  for (; i + needle_length - 1 + 16 <= length; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(const void *)(data + i));
+    __m128i b = _mm_loadu_si128(
+        (const __m128i *)(const void *)(data + i + needle_length - 1));
+    unsigned mask = (unsigned)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(data + i + bit + 1, needle + 1, needle_length - 2) == 0) {
+        return i + bit;
+      }
+      mask &= mask - 1;
     }
-    start -= 1;
   }
-  return -1;
+  int64_t found =
+      text_find_scalar(data + i, length - i, needle, needle_length);
+  return found < 0 ? -1 : i + found;
 }
 
-#define TERM_INPUT_BUFFER_SIZE (10)
-
-struct Terminal {
-  struct termios original_mode;
-  struct Buffer buffer;
-  int input_fileno;
-  int output_fileno;
-  int rows;
-  int columns;
+__attribute__((target("avx2"))) static int64_t
+text_find_avx2(const char *data, int64_t length, const char *needle,
+               int64_t needle_length) {
+  if (needle_length < 2) {
+    return needle_length ? text_find_byte_avx2(data, length, needle[0]) : 0;
+  }
 
-  int input_buffer_count;
-  char input_buffer[TERM_INPUT_BUFFER_SIZE];
-};
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[needle_length - 1]);
+  int64_t i = 0;
+  for (; i + needle_length - 1 + 32 <= length; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(const void *)(data + i));
+    __m256i b = _mm256_loadu_si256(
+        (const __m256i *)(const void *)(data + i + needle_length - 1));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(data + i + bit + 1, needle + 1, needle_length - 2) == 0) {
+        return i + bit;
+      }
+      mask &= mask - 1;
+    }
+  }
+  int64_t found = text_find_sse2(data + i, length - i, needle, needle_length);
+  return found < 0 ? -1 : i + found;
+}
+#endif
 
-static struct Terminal *global_terminal = NULL;
+static int64_t text_find_select(const char *data, int64_t length,
+                                const char *needle, int64_t needle_length);
 
-static void term_atexit(void);
+static int64_t (*text_find)(const char *, int64_t, const char *,
+                            int64_t) = text_find_select;
 
-static int term_get_size(int fileno, int *rows, int *cols) {
-  struct winsize ws;
-  if (ioctl(fileno, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-    // TODO: Complex escape codes to get the actual size. :P
-    return -1;
+static int64_t text_find_select(const char *data, int64_t length,
+                                const char *needle, int64_t needle_length) {
+#ifdef NIB_X86
+  if (__builtin_cpu_supports("avx2")) {
+    text_find = text_find_avx2;
   } else {
-    *cols = ws.ws_col;
-    *rows = ws.ws_row;
-    return 0;
+    text_find = text_find_sse2;
   }
+#else
+  text_find = text_find_scalar;
+#endif
+  return text_find(data, length, needle, needle_length);
 }
 
-static void term_init(struct Terminal *terminal, int input_fileno,
-                      int output_fileno) {
-  global_terminal = terminal;
-  terminal->input_fileno = input_fileno;
-  terminal->output_fileno = output_fileno;
-  buffer_init(&terminal->buffer);
-  terminal->input_buffer_count = 0;
-
-  // Setup raw mode for the terminal.
-  if (tcgetattr(input_fileno, &terminal->original_mode) == -1) {
-    die("tcgetattr setting raw");
+// Find the last occurrence of a string in the data, or -1. These mirror
+// text_find: Horspool run backwards, and vector versions that check the
+// first and last bytes of the needle a block at a time from the end.
+static int64_t text_rfind_scalar(const char *data, int64_t length,
+                                 const char *needle, int64_t needle_length) {
+  if (needle_length > length) {
+    return -1;
   }
-  struct termios raw = terminal->original_mode;
-  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-  raw.c_oflag &= ~(OPOST);
-  raw.c_cflag |= (CS8);
-  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-
-  raw.c_cc[VMIN] = 0;  // Minimum characters before returning.
-  raw.c_cc[VTIME] = 1; // Timeout in 100ms increments.
-
-  if (tcsetattr(input_fileno, TCSAFLUSH, &raw) == -1) {
-    die("tcsetattr setting raw");
+  if (needle_length == 0) {
+    return length;
+  }
+  if (needle_length == 1) {
+    return text_rfind_byte(data, length, needle[0]);
   }
 
-  if (term_get_size(input_fileno, &terminal->rows, &terminal->columns)) {
-    die("term_get_size");
+  int64_t skip[256];
+  for (int i = 0; i < 256; i++) {
+    skip[i] = needle_length;
+  }
+  for (int64_t i = needle_length - 1; i > 0; i--) {
+    skip[(unsigned char)needle[i]] = i;
   }
 
-  atexit(term_atexit);
+  int64_t i = length - needle_length;
+  while (i >= 0) {
+    char c = data[i];
+    if (c == needle[0] &&
+        memcmp(data + i + 1, needle + 1, needle_length - 1) == 0) {
+      return i;
+    }
+    i -= skip[(unsigned char)c];
+  }
+  return -1;
 }
 
-static void term_free(struct Terminal *terminal) {
-  struct termios *original = &(terminal->original_mode);
-  if (tcsetattr(terminal->input_fileno, TCSAFLUSH, original) == -1) {
-    die("tcsetattr");
+#ifdef NIB_X86
+static int64_t text_rfind_sse2(const char *data, int64_t length,
+                               const char *needle, int64_t needle_length) {
+  if (needle_length > length) {
+    return -1;
+  }
+  if (needle_length < 2) {
+    return needle_length ? text_rfind_byte_sse2(data, length, needle[0])
+                         : length;
   }
-  buffer_free(&terminal->buffer);
-  global_terminal = NULL;
-}
 
-static void term_atexit(void) {
-  if (global_terminal) {
-    term_free(global_terminal);
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[needle_length - 1]);
+  // Every match starts before i.
+  int64_t i = length - needle_length + 1;
+  while (i >= 16) {
+    i -= 16;
+    __m128i a = _mm_loadu_si128((const __m128i *)(const void *)(data + i));
+    __m128i b = _mm_loadu_si128(
+        (const __m128i *)(const void *)(data + i + needle_length - 1));
+    unsigned mask = (unsigned)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = 31 - __builtin_clz(mask);
+      if (memcmp(data + i + bit + 1, needle + 1, needle_length - 2) == 0) {
+        return i + bit;
+      }
+      mask &= ~(1u << bit);
+    }
   }
+  return text_rfind_scalar(data, i + needle_length - 1, needle,
+                           needle_length);
 }
 
-static char term_read_raw(struct Terminal *terminal) {
-  if (terminal->input_buffer_count) {
-    terminal->input_buffer_count -= 1;
-    return terminal->input_buffer[terminal->input_buffer_count];
+__attribute__((target("avx2"))) static int64_t
+text_rfind_avx2(const char *data, int64_t length, const char *needle,
+                int64_t needle_length) {
+  if (needle_length > length) {
+    return -1;
+  }
+  if (needle_length < 2) {
+    return needle_length ? text_rfind_byte_avx2(data, length, needle[0])
+                         : length;
   }
 
-  int nread;
-  char c;
-  while ((nread = read(terminal->input_fileno, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) {
-      die("read");
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[needle_length - 1]);
+  int64_t i = length - needle_length + 1;
+  while (i >= 32) {
+    i -= 32;
+    __m256i a = _mm256_loadu_si256((const __m256i *)(const void *)(data + i));
+    __m256i b = _mm256_loadu_si256(
+        (const __m256i *)(const void *)(data + i + needle_length - 1));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = 31 - __builtin_clz(mask);
+      if (memcmp(data + i + bit + 1, needle + 1, needle_length - 2) == 0) {
+        return i + bit;
+      }
+      mask &= ~(1u << bit);
     }
   }
-  return c;
+  return text_rfind_sse2(data, i + needle_length - 1, needle, needle_length);
 }
+#endif
+
+static int64_t text_rfind_select(const char *data, int64_t length,
+                                 const char *needle, int64_t needle_length);
 
-static void term_unread_char(struct Terminal *terminal, char c) {
-  if (terminal->input_buffer_count == TERM_INPUT_BUFFER_SIZE) {
-    die("overflow on unread buffer");
+static int64_t (*text_rfind)(const char *, int64_t, const char *,
+                             int64_t) = text_rfind_select;
+
+static int64_t text_rfind_select(const char *data, int64_t length,
+                                 const char *needle, int64_t needle_length) {
+#ifdef NIB_X86
+  if (__builtin_cpu_supports("avx2")) {
+    text_rfind = text_rfind_avx2;
+  } else {
+    text_rfind = text_rfind_sse2;
   }
-  terminal->input_buffer[terminal->input_buffer_count] = c;
-  terminal->input_buffer_count += 1;
+#else
+  text_rfind = text_rfind_scalar;
+#endif
+  return text_rfind(data, length, needle, needle_length);
 }
 
-#define KEY_CONTROL(c) (c - 'a' + 1)
-
-enum TermKey {
-  KEY_NONE = 0,
-  KEY_CONTROL_A = KEY_CONTROL('a'),
-  KEY_CONTROL_C = KEY_CONTROL('c'),
-  KEY_CONTROL_E = KEY_CONTROL('e'),
-  KEY_CONTROL_H = KEY_CONTROL('h'),
-  KEY_CONTROL_M = KEY_CONTROL('m'),
-  KEY_CONTROL_X = KEY_CONTROL('x'),
-  KEY_DEL = 127,
-  KEY_LEFT = 256,
-  KEY_RIGHT = 257,
-  KEY_UP = 258,
-  KEY_DOWN = 259,
-  KEY_HOME = 260,
-  KEY_END = 261,
-  KEY_PAGE_UP = 262,
-  KEY_PAGE_DOWN = 263,
+// Count the newlines in the data, and note where the first and last ones
+// are (-1 if there aren't any). Loading a document and building its line
+// index run this over the whole thing, so it gets the same treatment as
+// text_find_byte.
+struct TextStats {
+  int64_t newlines;
+  int64_t first_newline;
+  int64_t last_newline;
 };
 
-static enum TermKey term_read(struct Terminal *terminal) {
-  char c1 = term_read_raw(terminal);
-  if (c1 == '\x1b') {
-    char c2 = term_read_raw(terminal);
-    if (c2 == '[') {
-      char c3 = term_read_raw(terminal);
-      switch (c3) {
-      case 'A':
-        return KEY_UP;
-      case 'B':
-        return KEY_DOWN;
-      case 'C':
-        return KEY_RIGHT;
-      case 'D':
-        return KEY_LEFT;
-      case 'H': // "PC function key"
-        return KEY_HOME;
-      case 'F': // "PC function key"
-        return KEY_END;
-      case '1': {
-        char c4 = term_read_raw(terminal);
-        switch (c4) {
-        case '~': // VT 220
-          return KEY_HOME;
-        }
-        term_unread_char(terminal, c4);
-        break;
-      }
-      case '4': {
-        char c4 = term_read_raw(terminal);
-        switch (c4) {
-        case '~': // VT 220
-          return KEY_END;
-        }
-        term_unread_char(terminal, c4);
-        break;
-      }
-      case '5': {
-        char c4 = term_read_raw(terminal);
-        switch (c4) {
-        case '~':
-          return KEY_PAGE_UP;
-        }
-        term_unread_char(terminal, c4);
-        break;
-      }
-      case '6': {
-        char c4 = term_read_raw(terminal);
-        switch (c4) {
-        case '~':
-          return KEY_PAGE_DOWN;
-        }
-        term_unread_char(terminal, c4);
-        break;
-      }
-
-      default:
-        break;
+static void text_stats_scalar_from(const char *data, int64_t start,
+                                   int64_t length, struct TextStats *stats) {
+  for (int64_t i = start; i < length; i++) {
+    if (data[i] == '\n') {
+      if (stats->first_newline < 0) {
+        stats->first_newline = i;
       }
-
-      term_unread_char(terminal, c3);
+      stats->last_newline = i;
+      stats->newlines += 1;
     }
-
-    term_unread_char(terminal, c2);
   }
-  return c1;
 }
 
-static void term_set_cursor(struct Terminal *terminal, int row, int col) {
-  buffer_append(&terminal->buffer, "\x1b[", 2);
-  buffer_append_int(&terminal->buffer, row + 1);
-  buffer_append(&terminal->buffer, ";", 1);
-  buffer_append_int(&terminal->buffer, col + 1);
-  buffer_append(&terminal->buffer, "H", 1);
+static void text_stats_scalar(const char *data, int64_t length,
+                              struct TextStats *stats) {
+  stats->newlines = 0;
+  stats->first_newline = -1;
+  stats->last_newline = -1;
+  text_stats_scalar_from(data, 0, length, stats);
 }
 
-static void term_clear(struct Terminal *terminal) {
-  struct Buffer *buffer = &terminal->buffer;
-  buffer_clear(buffer);
-  buffer_append(buffer, "\x1b[?25l", 6); // Hide cursor
-  buffer_append(buffer, "\x1b[2J", 4);   // Clear screen
-  buffer_append(buffer, "\x1b[H", 3);    // Cursor to upper-left
+#ifdef NIB_X86
+static void text_stats_sse2(const char *data, int64_t length,
+                            struct TextStats *stats) {
+  const __m128i newline = _mm_set1_epi8('\n');
+  stats->newlines = 0;
+  stats->first_newline = -1;
+  stats->last_newline = -1;
+
+  int64_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(const void *)(data + i));
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+    if (mask) {
+      if (stats->first_newline < 0) {
+        stats->first_newline = i + __builtin_ctz(mask);
+      }
+      stats->last_newline = i + 31 - __builtin_clz(mask);
+      stats->newlines += __builtin_popcount(mask);
+    }
+  }
+  text_stats_scalar_from(data, i, length, stats);
 }
 
-static void term_draw(struct Terminal *terminal) {
-  struct Buffer *buffer = &terminal->buffer;
-  buffer_append(buffer, "\x1b[?25h", 6); // Show cursor
-  write(terminal->output_fileno, buffer->memory, buffer->length);
+__attribute__((target("avx2,popcnt"))) static void
+text_stats_avx2(const char *data, int64_t length, struct TextStats *stats) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  stats->newlines = 0;
+  stats->first_newline = -1;
+  stats->last_newline = -1;
+
+  int64_t i = 0;
+  for (; i + 64 <= length; i += 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(const void *)(data + i));
+    __m256i b =
+        _mm256_loadu_si256((const __m256i *)(const void *)(data + i + 32));
+    uint64_t mask_a =
+        (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, newline));
+    uint64_t mask_b =
+        (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, newline));
+    uint64_t mask = mask_a | (mask_b << 32);
+    if (mask) {
+      if (stats->first_newline < 0) {
+        stats->first_newline = i + __builtin_ctzll(mask);
+      }
+      stats->last_newline = i + 63 - __builtin_clzll(mask);
+      stats->newlines += __builtin_popcountll(mask);
+    }
+  }
+  text_stats_scalar_from(data, i, length, stats);
 }
+#endif
 
-static void term_write(struct Terminal *terminal, const char *data,
-                       int length) {
-  buffer_append(&terminal->buffer, data, length);
+static void text_stats_select(const char *data, int64_t length,
+                              struct TextStats *stats);
+
+static void (*text_stats)(const char *, int64_t,
+                          struct TextStats *) = text_stats_select;
+
+static void text_stats_select(const char *data, int64_t length,
+                              struct TextStats *stats) {
+#ifdef NIB_X86
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+    text_stats = text_stats_avx2;
+  } else {
+    text_stats = text_stats_sse2;
+  }
+#else
+  text_stats = text_stats_scalar;
+#endif
+  text_stats(data, length, stats);
 }
 
-struct Editor;
-struct KeyMap;
-typedef void (*KEY_FN)(struct Editor *, int);
+static int64_t text_count_newlines(const char *data, int64_t length) {
+  struct TextStats stats;
+  text_stats(data, length, &stats);
+  return stats.newlines;
+}
 
-struct KeyBinding {
-  enum TermKey key;
-  KEY_FN fn;
-  struct KeyMap *map;
+// The versions of each kernel, for text_bench. The ones this CPU can't run
+// are skipped.
+static const struct TextKernels {
+  const char *name;
+  int64_t (*find_byte)(const char *, int64_t, char);
+  int64_t (*rfind_byte)(const char *, int64_t, char);
+  int64_t (*find)(const char *, int64_t, const char *, int64_t);
+  int64_t (*rfind)(const char *, int64_t, const char *, int64_t);
+  void (*stats)(const char *, int64_t, struct TextStats *);
+} text_kernels[] = {
+    {"scalar", text_find_byte_scalar, text_rfind_byte_scalar,
+     text_find_scalar, text_rfind_scalar, text_stats_scalar},
+#ifdef NIB_X86
+    {"sse2", text_find_byte_sse2, text_rfind_byte_sse2, text_find_sse2,
+     text_rfind_sse2, text_stats_sse2},
+    {"avx2", text_find_byte_avx2, text_rfind_byte_avx2, text_find_avx2,
+     text_rfind_avx2, text_stats_avx2},
+#endif
 };
 
-struct KeyMap {
-  struct KeyBinding *bindings;
-  struct KeyMap *parent;
-  int capacity;
-  int count;
-  int refs;
+static int text_kernels_supported(const struct TextKernels *kernels) {
+#ifdef NIB_X86
+  if (strcmp(kernels->name, "avx2") == 0) {
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+  }
+#endif
+  UNUSED(kernels);
+  return 1;
+}
+
+// How long to keep running each kernel, to get past the noise.
+#define TEXT_BENCH_MIN_US (300000)
+
+enum TextKernel {
+  TEXT_FIND_BYTE,
+  TEXT_RFIND_BYTE,
+  TEXT_FIND,
+  TEXT_RFIND,
+  TEXT_STATS,
+  TEXT_KERNEL_COUNT,
 };
 
-static void keymap_init(struct KeyMap **map, struct KeyMap *parent) {
-  const int keymap_initial_size = 16;
-  struct KeyMap *m = malloc(sizeof(struct KeyMap));
-  if (!m) {
-    die("Cannot allocate keymap");
-  }
-  m->bindings = malloc(sizeof(struct KeyBinding) * keymap_initial_size);
-  m->parent = parent;
-  m->capacity = keymap_initial_size;
-  m->count = 0;
-  m->refs = 1;
+static const char *const text_kernel_names[TEXT_KERNEL_COUNT] = {
+    "text_find_byte", "text_rfind_byte", "text_find", "text_rfind",
+    "text_stats"};
 
-  if (parent) {
-    parent->refs += 1;
+// Run one kernel of a set, looking for the byte or the needle. text_stats
+// gives back the newline count, and fills in stats.
+static int64_t text_kernel_run(const struct TextKernels *kernels,
+                               enum TextKernel kernel, const char *data,
+                               int64_t length, char byte, const char *needle,
+                               int64_t needle_length,
+                               struct TextStats *stats) {
+  switch (kernel) {
+  case TEXT_FIND_BYTE:
+    return kernels->find_byte(data, length, byte);
+  case TEXT_RFIND_BYTE:
+    return kernels->rfind_byte(data, length, byte);
+  case TEXT_FIND:
+    return kernels->find(data, length, needle, needle_length);
+  case TEXT_RFIND:
+    return kernels->rfind(data, length, needle, needle_length);
+  case TEXT_STATS:
+    kernels->stats(data, length, stats);
+    return stats->newlines;
+  case TEXT_KERNEL_COUNT:
+    break;
   }
-  *map = m;
-}
-
-static struct KeyMap *keymap_ref(struct KeyMap *map) {
-  map->refs += 1;
-  return map;
+  return 0;
 }
 
-static void keymap_free(struct KeyMap **map) {
-  if (map) {
-    struct KeyMap *m = *map;
-    while (m) {
-      m->refs -= 1;
-      if (m->refs) {
-        break;
+// Check every version of every kernel against the scalar one, on short
+// texts of a few letters where there is plenty to find, at every alignment
+// and across the ends of the vector blocks. Returns how many disagreed.
+static int text_check(void) {
+  char data[300];
+  int failures = 0;
+  uint32_t seed = 1;
+  int count = (int)(sizeof(text_kernels) / sizeof(text_kernels[0]));
+  for (int round = 0; round < 20000; round++) {
+    seed = seed * 1103515245 + 12345;
+    int length = (int)(seed >> 16) % (int)sizeof(data);
+    for (int i = 0; i < length; i++) {
+      seed = seed * 1103515245 + 12345;
+      data[i] = "ab\nab\nabcdefgh"[(seed >> 16) % 15];
+    }
+    const char *needles[] = {"a", "c", "\n", "ab", "ba\n", "abcab", "hh"};
+    const char *needle = needles[round % 7];
+    int64_t needle_length = (int64_t)strlen(needle);
+    for (int kernel = 0; kernel < TEXT_KERNEL_COUNT; kernel++) {
+      struct TextStats expected_stats;
+      int64_t expected =
+          text_kernel_run(&text_kernels[0], kernel, data, length, needle[0],
+                          needle, needle_length, &expected_stats);
+      for (int i = 1; i < count; i++) {
+        if (!text_kernels_supported(&text_kernels[i])) {
+          continue;
+        }
+        struct TextStats stats;
+        int64_t result =
+            text_kernel_run(&text_kernels[i], kernel, data, length, needle[0],
+                            needle, needle_length, &stats);
+        if (kernel == TEXT_STATS &&
+            (stats.first_newline != expected_stats.first_newline ||
+             stats.last_newline != expected_stats.last_newline)) {
+          result = -2;
+        }
+        if (result != expected && failures++ < 10) {
+          printf("%s %s: %lld, not %lld, for \"%s\" in %d bytes\n",
+                 text_kernel_names[kernel], text_kernels[i].name,
+                 (long long)result, (long long)expected, needle, length);
+        }
       }
-
-      struct KeyMap *parent = m->parent;
-      free(m->bindings);
-      m->bindings = NULL;
-      free(m);
-      m = parent;
     }
-    *map = NULL;
   }
+  return failures;
 }
 
-static void keymap_set(struct KeyMap **dst, struct KeyMap *src) {
-  struct KeyMap *tmp = *dst;
-  *dst = keymap_ref(src);
-  keymap_free(&tmp);
-}
+// Check the kernels, then time each version of each one over length bytes
+// of text-like data, and print how fast it goes. Nothing it looks for is in
+// the data, so every kernel reads all of it. Run with
+// "nib --bench [megabytes]"; returns non-zero if a check failed.
+static int text_bench(int64_t length) {
+  int failures = text_check();
+  printf("%s against scalar\n", failures ? "FAILED checks" : "Checked");
 
-static void keymap_bind_key_fn(struct KeyMap *map, int key, KEY_FN fn) {
-  if (map->count == map->capacity) {
-    map->capacity *= 2;
-    map->bindings =
-        realloc(map->bindings, sizeof(struct KeyBinding) * map->capacity);
+  char *data = malloc(length);
+  if (!data) {
+    die("Cannot allocate benchmark data");
   }
-  struct KeyBinding *binding = &(map->bindings[map->count]);
-  binding->key = key;
-  binding->fn = fn;
-  map->count += 1;
-}
+  uint32_t seed = 1;
+  for (int64_t i = 0; i < length; i++) {
+    seed = seed * 1103515245 + 12345;
+    int r = (int)(seed >> 16) % 64;
+    data[i] = r == 0 ? '\n' : r < 10 ? ' ' : (char)('a' + r % 26);
+  }
+  const char *needle = "needle";
+  int64_t needle_length = (int64_t)strlen(needle);
 
-static void keymap_bind_key_map(struct KeyMap *map, int key,
-                                struct KeyMap *sub) {
-  if (map->count == map->capacity) {
-    map->capacity *= 2;
-    map->bindings =
-        realloc(map->bindings, sizeof(struct KeyBinding) * map->capacity);
+  printf("%lld MB of text\n", (long long)(length >> 20));
+  int count = (int)(sizeof(text_kernels) / sizeof(text_kernels[0]));
+  for (int kernel = 0; kernel < TEXT_KERNEL_COUNT; kernel++) {
+    for (int i = 0; i < count; i++) {
+      const struct TextKernels *kernels = &text_kernels[i];
+      if (!text_kernels_supported(kernels)) {
+        continue;
+      }
+      struct TextStats stats;
+      int64_t result = 0;
+      int64_t runs = 0;
+      int64_t start_us = clock_us();
+      int64_t elapsed_us;
+      do {
+        result = text_kernel_run(kernels, kernel, data, length, '\x01',
+                                 needle, needle_length, &stats);
+        runs += 1;
+        elapsed_us = clock_us() - start_us;
+      } while (elapsed_us < TEXT_BENCH_MIN_US);
+      printf("%-15s %-7s %7.2f GB/s  (%lld)\n", text_kernel_names[kernel],
+             kernels->name,
+             (double)(length * runs) / ((double)elapsed_us * 1000.0),
+             (long long)result);
+    }
   }
-  struct KeyBinding *binding = &(map->bindings[map->count]);
-  binding->key = key;
-  binding->map = keymap_ref(sub);
-  map->count += 1;
+  free(data);
+  return failures;
 }
 
-static struct KeyBinding *keymap_lookup(struct KeyMap *map, enum TermKey key) {
-  for (int i = map->count - 1; i >= 0; i--) {
-    struct KeyBinding *binding = &map->bindings[i];
-    if (binding->key == key) {
-      return binding;
-    }
+// What to grow a block of capacity bytes to so that it holds required
+// bytes: double it until it does, but not past INT_MAX, which is as far as
+// an int reaches. Doubling in an int would overflow past 1 GB.
+static int capacity_grow(int capacity, int64_t required) {
+  if (required > INT_MAX) {
+    die("Block too large");
   }
-  return NULL;
+  int64_t grown = capacity > 0 ? capacity : 1;
+  while (grown < required) {
+    grown *= 2;
+  }
+  return grown > INT_MAX ? INT_MAX : (int)grown;
 }
 
-struct Editor {
-  struct KeyMap *default_keymap;
-  struct KeyMap *current_keymap;
-  struct Buffer buffer;
-  struct Buffer status_buffer;
-  int row;
-  int column;
-  int position;
+struct Buffer {
+  char *memory;
+  int length;
+  int capacity;
+};
+
+static void buffer_init(struct Buffer *buffer) {
+  const int initial_buffer_size = 4 * 1024;
+  buffer->memory = malloc(initial_buffer_size);
+  buffer->length = 0;
+  buffer->capacity = initial_buffer_size;
+}
+
+static void buffer_free(struct Buffer *buffer) {
+  free(buffer->memory);
+  buffer->memory = NULL;
+  buffer->capacity = 0;
+  buffer->length = 0;
+}
+
+// Replace length bytes at position with the given data. Whatever the sizes,
+// the tail of the buffer moves at most once.
+static void buffer_replace(struct Buffer *buffer, int position, int length,
+                           const char *data, int data_length) {
+  if (position < 0 || length < 0 || data_length < 0) {
+    die("negative position or length");
+  }
+  if (position > buffer->length || length > buffer->length - position) {
+    die("replace past the end of the buffer");
+  }
+
+  // Ensure we have enough space in the buffer.
+  int64_t new_length = (int64_t)buffer->length - length + data_length;
+  if (new_length > buffer->capacity) {
+    int new_capacity = capacity_grow(buffer->capacity, new_length);
+    buffer->memory = realloc(buffer->memory, new_capacity);
+    if (!buffer->memory) {
+      die("Cannot grow buffer");
+    }
+    buffer->capacity = new_capacity;
+  }
+
+  // Make the hole the right size, if we need to.
+  int tail = position + length;
+  if (tail < buffer->length && length != data_length) {
+    memmove(buffer->memory + position + data_length, buffer->memory + tail,
+            buffer->length - tail);
+  }
+
+  // Copy into the hole.
+  if (data_length) {
+    memcpy(buffer->memory + position, data, data_length);
+  }
+  buffer->length = (int)new_length;
+}
+
+static void buffer_insert(struct Buffer *buffer, int position, const char *data,
+                          int length) {
+  buffer_replace(buffer, position, 0, data, length);
+}
+
+static void buffer_erase(struct Buffer *buffer, int position, int length) {
+  buffer_replace(buffer, position, length, NULL, 0);
+}
+
+static void buffer_append(struct Buffer *buffer, const char *data, int length) {
+  buffer_insert(buffer, buffer->length, data, length);
+}
+
+static void buffer_append_int(struct Buffer *buffer, int value) {
+  char txt[21]; // -9,223,372,036,854,775,807
+
+  char *end = txt + 21;
+  char *cursor = end;
+
+  int neg = 0;
+  if (value < 0) {
+    neg = 1;
+    value = -value;
+  }
+
+  while (value) {
+    cursor -= 1;
+    *cursor = (value % 10) + '0';
+    value /= 10;
+  }
+
+  if (neg) {
+    cursor -= 1;
+    *cursor = '-';
+  }
+
+  buffer_append(buffer, cursor, end - cursor);
+}
+
+static void buffer_clear(struct Buffer *buffer) { buffer->length = 0; }
+
+// Append everything in the file. Returns non-zero if it can't be read.
+static int buffer_append_file(struct Buffer *buffer, const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return -1;
+  }
+  char chunk[4096];
+  size_t nread;
+  while ((nread = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    buffer_append(buffer, chunk, (int)nread);
+  }
+  int failed = ferror(file);
+  fclose(file);
+  return failed ? -1 : 0;
+}
+
+// A gap buffer holds the text of a document. The text lives in one block of
+// memory with a hole in it (the "gap"); the gap is kept where edits happen,
+// which is almost always at the cursor, so that inserting or erasing a
+// character only has to touch the edges of the gap. Moving the gap costs the
+// distance moved, which is paid once per jump rather than once per keystroke.
+//
+// Positions in the API are logical: they do not count the gap.
+struct GapBuffer {
+  char *memory;
+  int gap_start;
+  int gap_end;
+  int capacity;
+};
+
+static void gap_init(struct GapBuffer *gap) {
+  const int initial_gap_size = 4 * 1024;
+  gap->memory = malloc(initial_gap_size);
+  if (!gap->memory) {
+    die("Cannot allocate gap buffer");
+  }
+  gap->gap_start = 0;
+  gap->gap_end = initial_gap_size;
+  gap->capacity = initial_gap_size;
+}
+
+static void gap_free(struct GapBuffer *gap) {
+  free(gap->memory);
+  gap->memory = NULL;
+  gap->gap_start = 0;
+  gap->gap_end = 0;
+  gap->capacity = 0;
+}
+
+static int gap_length(struct GapBuffer *gap) {
+  return gap->capacity - (gap->gap_end - gap->gap_start);
+}
+
+// Move the gap so that it starts at the given position.
+static void gap_move(struct GapBuffer *gap, int position) {
+  if (position < 0 || position > gap_length(gap)) {
+    die("gap position out of range");
+  }
+
+  if (position < gap->gap_start) {
+    int distance = gap->gap_start - position;
+    memmove(gap->memory + gap->gap_end - distance, gap->memory + position,
+            distance);
+    gap->gap_start -= distance;
+    gap->gap_end -= distance;
+  } else if (position > gap->gap_start) {
+    int distance = position - gap->gap_start;
+    memmove(gap->memory + gap->gap_start, gap->memory + gap->gap_end,
+            distance);
+    gap->gap_start += distance;
+    gap->gap_end += distance;
+  }
+}
+
+static void gap_reserve(struct GapBuffer *gap, int length) {
+  if (gap->gap_end - gap->gap_start >= length) {
+    return;
+  }
+
+  int new_capacity =
+      capacity_grow(gap->capacity, (int64_t)gap_length(gap) + length);
+
+  char *memory = realloc(gap->memory, new_capacity);
+  if (!memory) {
+    die("Cannot grow gap buffer");
+  }
+
+  // Slide the text after the gap up to the new end of the block.
+  int tail = gap->capacity - gap->gap_end;
+  memmove(memory + new_capacity - tail, memory + gap->gap_end, tail);
+  gap->memory = memory;
+  gap->gap_end = new_capacity - tail;
+  gap->capacity = new_capacity;
+}
+
+static void gap_insert(struct GapBuffer *gap, int position, const char *data,
+                       int length) {
+  if (length < 0) {
+    die("negative length");
+  }
+  gap_move(gap, position);
+  gap_reserve(gap, length);
+  memcpy(gap->memory + gap->gap_start, data, length);
+  gap->gap_start += length;
+}
+
+static void gap_erase(struct GapBuffer *gap, int position, int length) {
+  if (position < gap_length(gap) && position >= 0) {
+    if (length > gap_length(gap) - position) {
+      length = gap_length(gap) - position;
+    }
+    gap_move(gap, position);
+    gap->gap_end += length;
+  }
+}
+
+static char gap_at(struct GapBuffer *gap, int position) {
+  if (position < gap->gap_start) {
+    return gap->memory[position];
+  } else {
+    return gap->memory[position + (gap->gap_end - gap->gap_start)];
+  }
+}
+
+// The run of contiguous text that holds the position, and where it starts:
+// either everything before the gap or everything after it.
+static const char *gap_chunk(struct GapBuffer *gap, int position, int *start,
+                             int *length) {
+  if (position < gap->gap_start) {
+    *start = 0;
+    *length = gap->gap_start;
+    return gap->memory;
+  }
+  *start = gap->gap_start;
+  *length = gap->capacity - gap->gap_end;
+  return gap->memory + gap->gap_end;
+}
+
+// A piece table is the other way to hold the text of a document. The text as
+// it was loaded (the "original") is never modified; everything that gets
+// typed is appended to the "add" buffer, and the document is described by a
+// list of pieces, each of which is a span of one of those two buffers. Loading
+// a document just takes ownership of the loaded bytes, and edits only ever
+// touch the piece list.
+enum PieceSource {
+  PIECE_ORIGINAL,
+  PIECE_ADD,
+};
+
+struct Piece {
+  enum PieceSource source;
+  int start;
+  int length;
+};
+
+struct PieceTable {
+  char *original;
+  int original_length;
+  struct Buffer add;
+
+  struct Piece *pieces;
+  int count;
+  int capacity;
+  int length;
+
+  // The last piece we looked at, and the position where it starts. Motion and
+  // rendering tend to look at nearby positions, so lookups start here.
+  int cache_index;
+  int cache_start;
+};
+
+static void piece_init(struct PieceTable *table, char *original, int length) {
+  const int initial_piece_count = 16;
+  table->original = original;
+  table->original_length = length;
+  buffer_init(&table->add);
+
+  table->pieces = malloc(sizeof(struct Piece) * initial_piece_count);
+  if (!table->pieces) {
+    die("Cannot allocate piece table");
+  }
+  table->capacity = initial_piece_count;
+  table->count = 0;
+  table->length = length;
+  table->cache_index = 0;
+  table->cache_start = 0;
+
+  if (length > 0) {
+    struct Piece *piece = &table->pieces[0];
+    piece->source = PIECE_ORIGINAL;
+    piece->start = 0;
+    piece->length = length;
+    table->count = 1;
+  }
+}
+
+static void piece_free(struct PieceTable *table) {
+  free(table->original);
+  table->original = NULL;
+  table->original_length = 0;
+  buffer_free(&table->add);
+  free(table->pieces);
+  table->pieces = NULL;
+  table->capacity = 0;
+  table->count = 0;
+  table->length = 0;
+}
+
+static const char *piece_data(struct PieceTable *table, struct Piece *piece) {
+  if (piece->source == PIECE_ORIGINAL) {
+    return table->original + piece->start;
+  } else {
+    return table->add.memory + piece->start;
+  }
+}
+
+// Find the piece that contains the given position, and the position where
+// that piece starts. A position at the end of the document returns `count`.
+static int piece_locate(struct PieceTable *table, int position,
+                        int *piece_start) {
+  int index = table->cache_index;
+  int start = table->cache_start;
+  while (index > 0 && position < start) {
+    index -= 1;
+    start -= table->pieces[index].length;
+  }
+  while (index < table->count &&
+         position >= start + table->pieces[index].length) {
+    start += table->pieces[index].length;
+    index += 1;
+  }
+
+  table->cache_index = index;
+  table->cache_start = start;
+  *piece_start = start;
+  return index;
+}
+
+static void piece_insert_piece(struct PieceTable *table, int index,
+                               enum PieceSource source, int start,
+                               int length) {
+  if (table->count == table->capacity) {
+    table->capacity *= 2;
+    table->pieces =
+        realloc(table->pieces, sizeof(struct Piece) * table->capacity);
+    if (!table->pieces) {
+      die("Cannot grow piece table");
+    }
+  }
+  memmove(table->pieces + index + 1, table->pieces + index,
+          sizeof(struct Piece) * (table->count - index));
+  struct Piece *piece = &table->pieces[index];
+  piece->source = source;
+  piece->start = start;
+  piece->length = length;
+  table->count += 1;
+}
+
+static void piece_remove_piece(struct PieceTable *table, int index) {
+  memmove(table->pieces + index, table->pieces + index + 1,
+          sizeof(struct Piece) * (table->count - index - 1));
+  table->count -= 1;
+}
+
+static void piece_insert(struct PieceTable *table, int position,
+                         const char *data, int length) {
+  if (position < 0 || position > table->length || length < 0) {
+    die("piece insert out of range");
+  }
+  if (length == 0) {
+    return;
+  }
+
+  int add_start = table->add.length;
+  buffer_append(&table->add, data, length);
+
+  int start;
+  int index = piece_locate(table, position, &start);
+  int offset = position - start;
+  table->length += length;
+
+  if (offset == 0) {
+    // Typing extends the piece we typed last, rather than making a new piece
+    // for every key.
+    if (index > 0) {
+      struct Piece *previous = &table->pieces[index - 1];
+      if (previous->source == PIECE_ADD &&
+          previous->start + previous->length == add_start) {
+        previous->length += length;
+        table->cache_index = index - 1;
+        table->cache_start = start - (previous->length - length);
+        return;
+      }
+    }
+    piece_insert_piece(table, index, PIECE_ADD, add_start, length);
+  } else {
+    // Split the piece around the new text.
+    struct Piece *piece = &table->pieces[index];
+    enum PieceSource source = piece->source;
+    int tail_start = piece->start + offset;
+    int tail_length = piece->length - offset;
+    piece->length = offset;
+    piece_insert_piece(table, index + 1, PIECE_ADD, add_start, length);
+    piece_insert_piece(table, index + 2, source, tail_start, tail_length);
+  }
+}
+
+static void piece_erase(struct PieceTable *table, int position, int length) {
+  if (position < 0 || position >= table->length) {
+    return;
+  }
+  if (length > table->length - position) {
+    length = table->length - position;
+  }
+
+  // One piece at a time: each step cuts the front, the back or the middle
+  // out of a piece, or removes it entirely.
+  while (length > 0) {
+    int start;
+    int index = piece_locate(table, position, &start);
+    int offset = position - start;
+    struct Piece *piece = &table->pieces[index];
+    int cut = piece->length - offset;
+    if (cut > length) {
+      cut = length;
+    }
+
+    if (offset == 0) {
+      piece->start += cut;
+      piece->length -= cut;
+      if (piece->length == 0) {
+        piece_remove_piece(table, index);
+      }
+    } else if (offset + cut == piece->length) {
+      piece->length -= cut;
+    } else {
+      enum PieceSource source = piece->source;
+      int tail_start = piece->start + offset + cut;
+      int tail_length = piece->length - offset - cut;
+      piece->length = offset;
+      piece_insert_piece(table, index + 1, source, tail_start, tail_length);
+    }
+    table->length -= cut;
+    length -= cut;
+  }
+}
+
+static char piece_at(struct PieceTable *table, int position) {
+  int start;
+  int index = piece_locate(table, position, &start);
+  if (index >= table->count) {
+    return 0;
+  }
+  struct Piece *piece = &table->pieces[index];
+  return piece_data(table, piece)[position - start];
+}
+
+static const char *piece_chunk(struct PieceTable *table, int position,
+                               int *start, int *length) {
+  int index = piece_locate(table, position, start);
+  *length = table->pieces[index].length;
+  return piece_data(table, &table->pieces[index]);
+}
+
+// A rope holds documents too big for the other representations: it is a
+// B-tree whose leaves are chunks of text, and every node knows how many bytes
+// and newlines are underneath it. That makes edits and conversions between
+// offsets and lines O(log n), and lets searches for newlines skip any subtree
+// that doesn't have one. All offsets are 64-bit.
+#define ROPE_LEAF_SIZE (4096)
+#define ROPE_BRANCH (16)
+
+struct RopeNode {
+  int64_t bytes;
+  int64_t newlines;
+
+  // Leaves have text and no children; branches have children and no text.
+  // There is room for one extra child so that a branch can overflow before
+  // it is split.
+  char *text;
+  int count;
+  struct RopeNode *children[ROPE_BRANCH + 1];
+};
+
+struct Rope {
+  struct RopeNode *root;
+
+  // The last leaf we read from, and the offset where it starts. Reset on
+  // every edit.
+  struct RopeNode *cache_leaf;
+  int64_t cache_start;
+};
+
+static struct RopeNode *rope_new_leaf(void) {
+  struct RopeNode *node = malloc(sizeof(struct RopeNode));
+  if (!node) {
+    die("Cannot allocate rope leaf");
+  }
+  node->text = malloc(ROPE_LEAF_SIZE);
+  if (!node->text) {
+    die("Cannot allocate rope leaf");
+  }
+  node->bytes = 0;
+  node->newlines = 0;
+  node->count = 0;
+  return node;
+}
+
+static struct RopeNode *rope_new_branch(void) {
+  struct RopeNode *node = malloc(sizeof(struct RopeNode));
+  if (!node) {
+    die("Cannot allocate rope branch");
+  }
+  node->text = NULL;
+  node->bytes = 0;
+  node->newlines = 0;
+  node->count = 0;
+  return node;
+}
+
+static void rope_node_free(struct RopeNode *node) {
+  for (int i = 0; i < node->count; i++) {
+    rope_node_free(node->children[i]);
+  }
+  free(node->text);
+  free(node);
+}
+
+// Recompute a branch's totals from its children.
+static void rope_node_update(struct RopeNode *node) {
+  if (node->text) {
+    return;
+  }
+  node->bytes = 0;
+  node->newlines = 0;
+  for (int i = 0; i < node->count; i++) {
+    node->bytes += node->children[i]->bytes;
+    node->newlines += node->children[i]->newlines;
+  }
+}
+
+static void rope_init(struct Rope *rope, const char *data, int64_t length) {
+  rope->cache_leaf = NULL;
+  rope->cache_start = 0;
+
+  // Build the tree bottom up: full leaves, then a level of branches over
+  // them, and so on until there is only one node left.
+  int64_t count = (length + ROPE_LEAF_SIZE - 1) / ROPE_LEAF_SIZE;
+  if (count == 0) {
+    rope->root = rope_new_leaf();
+    return;
+  }
+
+  struct RopeNode **level = malloc(sizeof(struct RopeNode *) * count);
+  if (!level) {
+    die("Cannot allocate rope");
+  }
+  for (int64_t i = 0; i < count; i++) {
+    struct RopeNode *leaf = rope_new_leaf();
+    int64_t start = i * ROPE_LEAF_SIZE;
+    int64_t bytes = length - start;
+    if (bytes > ROPE_LEAF_SIZE) {
+      bytes = ROPE_LEAF_SIZE;
+    }
+    memcpy(leaf->text, data + start, bytes);
+    leaf->bytes = bytes;
+    leaf->newlines = text_count_newlines(leaf->text, bytes);
+    level[i] = leaf;
+  }
+
+  while (count > 1) {
+    int64_t parents = 0;
+    for (int64_t i = 0; i < count; i += ROPE_BRANCH) {
+      struct RopeNode *branch = rope_new_branch();
+      for (int64_t j = i; j < count && j < i + ROPE_BRANCH; j++) {
+        branch->children[branch->count] = level[j];
+        branch->count += 1;
+      }
+      rope_node_update(branch);
+      level[parents] = branch;
+      parents += 1;
+    }
+    count = parents;
+  }
+
+  rope->root = level[0];
+  free(level);
+}
+
+static void rope_free(struct Rope *rope) {
+  if (rope->root) {
+    rope_node_free(rope->root);
+    rope->root = NULL;
+  }
+  rope->cache_leaf = NULL;
+}
+
+static int64_t rope_length(struct Rope *rope) { return rope->root->bytes; }
+
+// Insert at most ROPE_LEAF_SIZE bytes into the subtree. If the node has to
+// split, the new right-hand sibling is returned.
+static struct RopeNode *rope_insert_node(struct RopeNode *node,
+                                         int64_t position, const char *data,
+                                         int length) {
+  if (node->text) {
+    int offset = (int)position;
+    if (node->bytes + length <= ROPE_LEAF_SIZE) {
+      memmove(node->text + offset + length, node->text + offset,
+              node->bytes - offset);
+      memcpy(node->text + offset, data, length);
+      node->bytes += length;
+      node->newlines += text_count_newlines(data, length);
+      return NULL;
+    }
+
+    char joined[2 * ROPE_LEAF_SIZE];
+    int total = (int)node->bytes + length;
+    memcpy(joined, node->text, offset);
+    memcpy(joined + offset, data, length);
+    memcpy(joined + offset + length, node->text + offset,
+           node->bytes - offset);
+
+    int half = total / 2;
+    struct RopeNode *right = rope_new_leaf();
+    memcpy(node->text, joined, half);
+    node->bytes = half;
+    node->newlines = text_count_newlines(node->text, half);
+    memcpy(right->text, joined + half, total - half);
+    right->bytes = total - half;
+    right->newlines = text_count_newlines(right->text, right->bytes);
+    return right;
+  }
+
+  // Inserting at a boundary goes at the end of the left child.
+  int index = 0;
+  int64_t start = 0;
+  while (index < node->count - 1 &&
+         position > start + node->children[index]->bytes) {
+    start += node->children[index]->bytes;
+    index += 1;
+  }
+
+  struct RopeNode *sibling =
+      rope_insert_node(node->children[index], position - start, data, length);
+  if (sibling) {
+    memmove(node->children + index + 2, node->children + index + 1,
+            sizeof(struct RopeNode *) * (node->count - index - 1));
+    node->children[index + 1] = sibling;
+    node->count += 1;
+  }
+
+  struct RopeNode *right = NULL;
+  if (node->count > ROPE_BRANCH) {
+    int half = node->count / 2;
+    right = rope_new_branch();
+    right->count = node->count - half;
+    memcpy(right->children, node->children + half,
+           sizeof(struct RopeNode *) * right->count);
+    node->count = half;
+    rope_node_update(right);
+  }
+  rope_node_update(node);
+  return right;
+}
+
+static void rope_insert(struct Rope *rope, int64_t position, const char *data,
+                        int64_t length) {
+  if (position < 0 || position > rope_length(rope) || length < 0) {
+    die("rope insert out of range");
+  }
+  rope->cache_leaf = NULL;
+
+  while (length > 0) {
+    int chunk = length > ROPE_LEAF_SIZE ? ROPE_LEAF_SIZE : (int)length;
+    struct RopeNode *sibling =
+        rope_insert_node(rope->root, position, data, chunk);
+    if (sibling) {
+      struct RopeNode *root = rope_new_branch();
+      root->children[0] = rope->root;
+      root->children[1] = sibling;
+      root->count = 2;
+      rope_node_update(root);
+      rope->root = root;
+    }
+    position += chunk;
+    data += chunk;
+    length -= chunk;
+  }
+}
+
+// Erase a range from the subtree. Children that end up empty are removed,
+// and neighbours that fit together are merged so the tree stays dense.
+static void rope_erase_node(struct RopeNode *node, int64_t position,
+                            int64_t length) {
+  if (node->text) {
+    int offset = (int)position;
+    int erased = (int)length;
+    node->newlines -= text_count_newlines(node->text + offset, erased);
+    memmove(node->text + offset, node->text + offset + erased,
+            node->bytes - offset - erased);
+    node->bytes -= erased;
+    return;
+  }
+
+  int64_t end = position + length;
+  int64_t start = 0;
+  for (int i = 0; i < node->count; i++) {
+    struct RopeNode *child = node->children[i];
+    int64_t child_end = start + child->bytes;
+    if (child_end > position && start < end) {
+      int64_t from = position > start ? position : start;
+      int64_t to = end < child_end ? end : child_end;
+      rope_erase_node(child, from - start, to - from);
+    }
+    start = child_end;
+  }
+
+  int kept = 0;
+  for (int i = 0; i < node->count; i++) {
+    struct RopeNode *child = node->children[i];
+    if (child->bytes == 0) {
+      rope_node_free(child);
+      continue;
+    }
+
+    if (kept > 0) {
+      struct RopeNode *previous = node->children[kept - 1];
+      if (child->text && previous->bytes + child->bytes <= ROPE_LEAF_SIZE) {
+        memcpy(previous->text + previous->bytes, child->text, child->bytes);
+        previous->bytes += child->bytes;
+        previous->newlines += child->newlines;
+        rope_node_free(child);
+        continue;
+      }
+      if (!child->text && previous->count + child->count <= ROPE_BRANCH) {
+        memcpy(previous->children + previous->count, child->children,
+               sizeof(struct RopeNode *) * child->count);
+        previous->count += child->count;
+        rope_node_update(previous);
+        child->count = 0;
+        rope_node_free(child);
+        continue;
+      }
+    }
+    node->children[kept] = child;
+    kept += 1;
+  }
+  node->count = kept;
+  rope_node_update(node);
+}
+
+static void rope_erase(struct Rope *rope, int64_t position, int64_t length) {
+  int64_t total = rope_length(rope);
+  if (position < 0 || position >= total || length <= 0) {
+    return;
+  }
+  if (position + length > total) {
+    length = total - position;
+  }
+  rope->cache_leaf = NULL;
+
+  rope_erase_node(rope->root, position, length);
+
+  // Shrink the tree from the top if the root is left with one child or none.
+  while (!rope->root->text && rope->root->count <= 1) {
+    struct RopeNode *root = rope->root;
+    if (root->count == 0) {
+      rope->root = rope_new_leaf();
+    } else {
+      rope->root = root->children[0];
+      root->count = 0;
+    }
+    rope_node_free(root);
+  }
+}
+
+// Find the leaf that holds the position, which must be in the rope.
+static struct RopeNode *rope_leaf(struct Rope *rope, int64_t position,
+                                  int64_t *leaf_start) {
+  struct RopeNode *leaf = rope->cache_leaf;
+  if (leaf && position >= rope->cache_start &&
+      position < rope->cache_start + leaf->bytes) {
+    *leaf_start = rope->cache_start;
+    return leaf;
+  }
+
+  struct RopeNode *node = rope->root;
+  int64_t start = 0;
+  while (!node->text) {
+    int index = 0;
+    while (position >= start + node->children[index]->bytes) {
+      start += node->children[index]->bytes;
+      index += 1;
+    }
+    node = node->children[index];
+  }
+
+  rope->cache_leaf = node;
+  rope->cache_start = start;
+  *leaf_start = start;
+  return node;
+}
+
+static char rope_at(struct Rope *rope, int64_t position) {
+  if (position < 0 || position >= rope_length(rope)) {
+    return 0;
+  }
+  int64_t start;
+  struct RopeNode *leaf = rope_leaf(rope, position, &start);
+  return leaf->text[position - start];
+}
+
+static const char *rope_chunk(struct Rope *rope, int64_t position,
+                              int64_t *start, int64_t *length) {
+  struct RopeNode *leaf = rope_leaf(rope, position, start);
+  *length = leaf->bytes;
+  return leaf->text;
+}
+
+// The line that the given offset is on: the number of newlines before it.
+static int64_t rope_line_of(struct Rope *rope, int64_t position) {
+  if (position >= rope_length(rope)) {
+    return rope->root->newlines;
+  }
+
+  struct RopeNode *node = rope->root;
+  int64_t start = 0;
+  int64_t line = 0;
+  while (!node->text) {
+    int index = 0;
+    while (position >= start + node->children[index]->bytes) {
+      start += node->children[index]->bytes;
+      line += node->children[index]->newlines;
+      index += 1;
+    }
+    node = node->children[index];
+  }
+  return line + text_count_newlines(node->text, position - start);
+}
+
+// The offset where the given line starts, or -1 if there is no such line.
+static int64_t rope_line_start(struct Rope *rope, int64_t line) {
+  if (line <= 0) {
+    return 0;
+  }
+  if (line > rope->root->newlines) {
+    return -1;
+  }
+
+  // Find the line'th newline; the line starts just after it.
+  struct RopeNode *node = rope->root;
+  int64_t start = 0;
+  int64_t remaining = line;
+  while (!node->text) {
+    int index = 0;
+    while (node->children[index]->newlines < remaining) {
+      start += node->children[index]->bytes;
+      remaining -= node->children[index]->newlines;
+      index += 1;
+    }
+    node = node->children[index];
+  }
+  int64_t newline = -1;
+  while (remaining > 0) {
+    int64_t found = text_find_byte(node->text + newline + 1,
+                                   node->bytes - newline - 1, '\n');
+    if (found < 0) {
+      return -1;
+    }
+    newline += 1 + found;
+    remaining -= 1;
+  }
+  return start + newline + 1;
+}
+
+// A line index remembers where every line starts, so that finding a line
+// doesn't mean counting newlines from the top of the document. It is kept the
+// same way as a gap buffer: starts before the gap are stored as offsets from
+// the beginning of the document, starts after it as offsets from the end.
+// An edit only has to add or drop the starts right around it, because the
+// ones after the gap move along with the end of the document for free.
+//
+// Line 0 always starts at 0, so entry i is the start of line i + 1.
+struct LineIndex {
+  int64_t *starts;
+  int64_t gap_start;
+  int64_t gap_end;
+  int64_t capacity;
+  int64_t length;
+};
+
+static void lines_init(struct LineIndex *lines, const char *text,
+                       int64_t length) {
+  struct TextStats stats;
+  text_stats(text, length, &stats);
+
+  lines->capacity = stats.newlines + 1024;
+  lines->starts = malloc(sizeof(int64_t) * lines->capacity);
+  if (!lines->starts) {
+    die("Cannot allocate line index");
+  }
+  lines->gap_start = 0;
+  lines->gap_end = lines->capacity;
+  lines->length = length;
+
+  // Everything between the first and last newline gets a start.
+  int64_t eol = stats.first_newline;
+  while (eol >= 0) {
+    lines->starts[lines->gap_start] = eol + 1;
+    lines->gap_start += 1;
+    if (eol == stats.last_newline) {
+      break;
+    }
+
+    eol += 1 + text_find_byte(text + eol + 1, stats.last_newline - eol, '\n');
+  }
+}
+
+static void lines_free(struct LineIndex *lines) {
+  free(lines->starts);
+  lines->starts = NULL;
+  lines->gap_start = 0;
+  lines->gap_end = 0;
+  lines->capacity = 0;
+  lines->length = 0;
+}
+
+static int64_t lines_count(struct LineIndex *lines) {
+  return lines->capacity - (lines->gap_end - lines->gap_start);
+}
+
+// The offset of the start of line entry + 1.
+static int64_t lines_entry(struct LineIndex *lines, int64_t entry) {
+  if (entry < lines->gap_start) {
+    return lines->starts[entry];
+  } else {
+    int64_t stored = lines->starts[entry + (lines->gap_end - lines->gap_start)];
+    return lines->length - stored;
+  }
+}
+
+// Move the gap so that every start before it is at or before the given
+// position, and every start after it is past the position.
+static void lines_move_gap(struct LineIndex *lines, int64_t position) {
+  while (lines->gap_start > 0 &&
+         lines->starts[lines->gap_start - 1] > position) {
+    lines->gap_start -= 1;
+    lines->gap_end -= 1;
+    lines->starts[lines->gap_end] =
+        lines->length - lines->starts[lines->gap_start];
+  }
+  while (lines->gap_end < lines->capacity &&
+         lines->length - lines->starts[lines->gap_end] <= position) {
+    lines->starts[lines->gap_start] =
+        lines->length - lines->starts[lines->gap_end];
+    lines->gap_start += 1;
+    lines->gap_end += 1;
+  }
+}
+
+static void lines_insert(struct LineIndex *lines, int64_t position,
+                         const char *data, int64_t length) {
+  lines_move_gap(lines, position);
+
+  int64_t added = text_count_newlines(data, length);
+  if (lines->gap_end - lines->gap_start < added) {
+    int64_t new_capacity = lines->capacity * 2;
+    while (new_capacity - lines_count(lines) < added) {
+      new_capacity *= 2;
+    }
+    int64_t *starts = realloc(lines->starts, sizeof(int64_t) * new_capacity);
+    if (!starts) {
+      die("Cannot grow line index");
+    }
+    int64_t tail = lines->capacity - lines->gap_end;
+    memmove(starts + new_capacity - tail, starts + lines->gap_end,
+            sizeof(int64_t) * tail);
+    lines->starts = starts;
+    lines->gap_end = new_capacity - tail;
+    lines->capacity = new_capacity;
+  }
+
+  int64_t eol = text_find_byte(data, length, '\n');
+  while (eol >= 0) {
+    lines->starts[lines->gap_start] = position + eol + 1;
+    lines->gap_start += 1;
+
+    int64_t found = text_find_byte(data + eol + 1, length - eol - 1, '\n');
+    eol = found < 0 ? -1 : eol + 1 + found;
+  }
+  lines->length += length;
+}
+
+static void lines_erase(struct LineIndex *lines, int64_t position,
+                        int64_t length) {
+  lines_move_gap(lines, position);
+
+  // Lines that started inside the erased range lost their newline.
+  while (lines->gap_end < lines->capacity &&
+         lines->length - lines->starts[lines->gap_end] <= position + length) {
+    lines->gap_end += 1;
+  }
+  lines->length -= length;
+}
+
+// The line that the given offset is on.
+static int64_t lines_line_of(struct LineIndex *lines, int64_t position) {
+  // Count the starts at or before the position.
+  int64_t low = 0;
+  int64_t high = lines_count(lines);
+  while (low < high) {
+    int64_t middle = low + (high - low) / 2;
+    if (lines_entry(lines, middle) <= position) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+// The offset where the given line starts, or -1 if there is no such line.
+static int64_t lines_line_start(struct LineIndex *lines, int64_t line) {
+  if (line <= 0) {
+    return 0;
+  }
+  if (line > lines_count(lines)) {
+    return -1;
+  }
+  return lines_entry(lines, line - 1);
+}
+
+// A document is the text the editor is working on, in whichever
+// representation suits it. Small documents live in a gap buffer; big ones get
+// a piece table, so that loading them doesn't copy and jumping around in them
+// doesn't drag a gap across megabytes of text; huge ones get a rope, which is
+// the only representation that can grow past 2 GB.
+enum DocumentKind {
+  DOCUMENT_GAP,
+  DOCUMENT_PIECES,
+  DOCUMENT_ROPE,
+};
+
+#define DOCUMENT_PIECES_THRESHOLD (1024 * 1024)
+#define DOCUMENT_ROPE_THRESHOLD (64 * 1024 * 1024)
+
+// The kind of document to load text of the given length into.
+static enum DocumentKind doc_kind_for(int64_t length) {
+  if (length >= DOCUMENT_ROPE_THRESHOLD) {
+    return DOCUMENT_ROPE;
+  }
+  if (length >= DOCUMENT_PIECES_THRESHOLD) {
+    return DOCUMENT_PIECES;
+  }
+  return DOCUMENT_GAP;
+}
+
+struct Document {
+  enum DocumentKind kind;
+  struct GapBuffer gap;
+  struct PieceTable pieces;
+  struct Rope rope;
+
+  // The rope keeps track of its own lines; the other representations use
+  // this index.
+  struct LineIndex lines;
+};
+
+static void doc_init(struct Document *doc, enum DocumentKind kind) {
+  doc->kind = kind;
+  lines_init(&doc->lines, NULL, 0);
+  switch (kind) {
+  case DOCUMENT_GAP:
+    gap_init(&doc->gap);
+    break;
+  case DOCUMENT_PIECES:
+    piece_init(&doc->pieces, NULL, 0);
+    break;
+  case DOCUMENT_ROPE:
+    rope_init(&doc->rope, NULL, 0);
+    break;
+  }
+}
+
+static void doc_free(struct Document *doc) {
+  lines_free(&doc->lines);
+  switch (doc->kind) {
+  case DOCUMENT_GAP:
+    gap_free(&doc->gap);
+    break;
+  case DOCUMENT_PIECES:
+    piece_free(&doc->pieces);
+    break;
+  case DOCUMENT_ROPE:
+    rope_free(&doc->rope);
+    break;
+  }
+}
+
+// Replace the contents of the document with length bytes of text in a block
+// of capacity bytes, which the document takes ownership of. Only a rope can
+// hold more than INT_MAX bytes, so longer text always makes one.
+static void doc_load_memory(struct Document *doc, enum DocumentKind kind,
+                            char *memory, int64_t length, int64_t capacity) {
+  if (length > INT_MAX) {
+    kind = DOCUMENT_ROPE;
+  }
+  if (capacity > INT_MAX) {
+    capacity = INT_MAX;
+  }
+  doc_free(doc);
+  doc->kind = kind;
+  if (kind == DOCUMENT_ROPE) {
+    lines_init(&doc->lines, NULL, 0);
+  } else {
+    lines_init(&doc->lines, memory, length);
+  }
+  switch (kind) {
+  case DOCUMENT_GAP:
+    doc->gap.memory = memory;
+    doc->gap.gap_start = (int)length;
+    doc->gap.gap_end = (int)capacity;
+    doc->gap.capacity = (int)capacity;
+    break;
+  case DOCUMENT_PIECES:
+    piece_init(&doc->pieces, memory, (int)length);
+    break;
+  case DOCUMENT_ROPE:
+    // The rope copies the text into its leaves.
+    rope_init(&doc->rope, memory, length);
+    free(memory);
+    break;
+  }
+}
+
+// The same for text in a buffer, which is left empty.
+static void doc_load(struct Document *doc, enum DocumentKind kind,
+                     struct Buffer *text) {
+  doc_load_memory(doc, kind, text->memory, text->length, text->capacity);
+  text->memory = NULL;
+  text->length = 0;
+  text->capacity = 0;
+}
+
+static int64_t doc_length(struct Document *doc) {
+  switch (doc->kind) {
+  case DOCUMENT_GAP:
+    return gap_length(&doc->gap);
+  case DOCUMENT_PIECES:
+    return doc->pieces.length;
+  case DOCUMENT_ROPE:
+    return rope_length(&doc->rope);
+  }
+  return 0;
+}
+
+static void doc_make_rope(struct Document *doc);
+
+static void doc_insert(struct Document *doc, int64_t position,
+                       const char *data, int64_t length) {
+  if (doc->kind != DOCUMENT_ROPE && doc_length(doc) + length > INT_MAX) {
+    // Only a rope holds that much.
+    doc_make_rope(doc);
+  }
+
+  if (doc->kind != DOCUMENT_ROPE) {
+    lines_insert(&doc->lines, position, data, length);
+  }
+
+  switch (doc->kind) {
+  case DOCUMENT_GAP:
+    gap_insert(&doc->gap, (int)position, data, (int)length);
+    break;
+  case DOCUMENT_PIECES:
+    piece_insert(&doc->pieces, (int)position, data, (int)length);
+    break;
+  case DOCUMENT_ROPE:
+    rope_insert(&doc->rope, position, data, length);
+    break;
+  }
+}
+
+static void doc_erase(struct Document *doc, int64_t position,
+                      int64_t length) {
+  if (position < 0 || position >= doc_length(doc) || length <= 0) {
+    return;
+  }
+  if (length > doc_length(doc) - position) {
+    length = doc_length(doc) - position;
+  }
+  if (doc->kind != DOCUMENT_ROPE) {
+    lines_erase(&doc->lines, position, length);
+  }
+
+  switch (doc->kind) {
+  case DOCUMENT_GAP:
+    gap_erase(&doc->gap, (int)position, (int)length);
+    break;
+  case DOCUMENT_PIECES:
+    piece_erase(&doc->pieces, (int)position, (int)length);
+    break;
+  case DOCUMENT_ROPE:
+    rope_erase(&doc->rope, position, length);
+    break;
+  }
+}
+
+static char doc_at(struct Document *doc, int64_t position) {
+  switch (doc->kind) {
+  case DOCUMENT_GAP:
+    return gap_at(&doc->gap, (int)position);
+  case DOCUMENT_PIECES:
+    return piece_at(&doc->pieces, (int)position);
+  case DOCUMENT_ROPE:
+    return rope_at(&doc->rope, position);
+  }
+  return 0;
+}
+
+// The contiguous run of text that holds the position, which must be in the
+// document, and where that run starts.
+static const char *doc_chunk(struct Document *doc, int64_t position,
+                             int64_t *start, int64_t *length) {
+  int small_start = 0;
+  int small_length = 0;
+  const char *chunk = NULL;
+  switch (doc->kind) {
+  case DOCUMENT_GAP:
+    chunk = gap_chunk(&doc->gap, (int)position, &small_start, &small_length);
+    break;
+  case DOCUMENT_PIECES:
+    chunk = piece_chunk(&doc->pieces, (int)position, &small_start,
+                        &small_length);
+    break;
+  case DOCUMENT_ROPE:
+    return rope_chunk(&doc->rope, position, start, length);
+  }
+  *start = small_start;
+  *length = small_length;
+  return chunk;
+}
+
+// Append a range of the document to the buffer.
+static void doc_copy(struct Document *doc, int64_t position, int64_t length,
+                     struct Buffer *out) {
+  while (length > 0) {
+    int64_t start;
+    int64_t chunk_length;
+    const char *chunk = doc_chunk(doc, position, &start, &chunk_length);
+    int64_t count = start + chunk_length - position;
+    if (count > length) {
+      count = length;
+    }
+    buffer_append(out, chunk + (position - start), (int)count);
+    position += count;
+    length -= count;
+  }
+}
+
+// Copy a range of the document into memory.
+static void doc_read(struct Document *doc, int64_t position, int64_t length,
+                     char *out) {
+  while (length > 0) {
+    int64_t start;
+    int64_t chunk_length;
+    const char *chunk = doc_chunk(doc, position, &start, &chunk_length);
+    int64_t count = start + chunk_length - position;
+    if (count > length) {
+      count = length;
+    }
+    memcpy(out, chunk + (position - start), count);
+    out += count;
+    position += count;
+    length -= count;
+  }
+}
+
+// Turn the document into a rope, keeping the text.
+static void doc_make_rope(struct Document *doc) {
+  int64_t length = doc_length(doc);
+  char *memory;
+  if (doc->kind == DOCUMENT_GAP) {
+    // Close the gap and hand the block over rather than copy it.
+    gap_move(&doc->gap, (int)length);
+    memory = doc->gap.memory;
+    doc->gap.memory = NULL;
+  } else {
+    memory = malloc(length > 0 ? length : 1);
+    if (!memory) {
+      die("Cannot allocate document");
+    }
+    doc_read(doc, 0, length, memory);
+  }
+  doc_load_memory(doc, DOCUMENT_ROPE, memory, length, length);
+}
+
+static int doc_matches(struct Document *doc, int64_t position,
+                       const char *needle, int64_t needle_length) {
+  for (int64_t i = 0; i < needle_length; i++) {
+    if (doc_at(doc, position + i) != needle[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Find the first match of the needle starting at or after the position, or
+// -1. Each chunk of the document is searched in place; only matches that
+// straddle the end of a chunk are checked a byte at a time.
+static int64_t doc_search(struct Document *doc, const char *needle,
+                          int64_t needle_length, int64_t position) {
+  int64_t total = doc_length(doc);
+  if (position < 0) {
+    position = 0;
+  }
+  if (needle_length == 0) {
+    return position <= total ? position : -1;
+  }
+
+  while (position + needle_length <= total) {
+    int64_t start;
+    int64_t length;
+    const char *chunk = doc_chunk(doc, position, &start, &length);
+    int64_t offset = position - start;
+    int64_t found =
+        text_find(chunk + offset, length - offset, needle, needle_length);
+    if (found >= 0) {
+      return position + found;
+    }
+
+    int64_t end = start + length;
+    int64_t straddle = end - needle_length + 1;
+    if (straddle < position) {
+      straddle = position;
+    }
+    for (; straddle < end && straddle + needle_length <= total; straddle++) {
+      if (doc_matches(doc, straddle, needle, needle_length)) {
+        return straddle;
+      }
+    }
+    position = end;
+  }
+  return -1;
+}
+
+// Find the last match of the needle starting at or before the position, or
+// -1.
+static int64_t doc_rsearch(struct Document *doc, const char *needle,
+                           int64_t needle_length, int64_t position) {
+  int64_t total = doc_length(doc);
+  if (position > total - needle_length) {
+    position = total - needle_length;
+  }
+  if (position < 0) {
+    // Before the start, or the needle is longer than the document.
+    return -1;
+  }
+  if (needle_length == 0) {
+    return position;
+  }
+
+  while (position >= 0) {
+    int64_t start;
+    int64_t length;
+    const char *chunk = doc_chunk(doc, position, &start, &length);
+
+    // Matches that run off the end of this chunk start after any that fit
+    // inside it, so try those first.
+    int64_t end = start + length;
+    for (int64_t s = position; s > end - needle_length && s >= start; s--) {
+      if (doc_matches(doc, s, needle, needle_length)) {
+        return s;
+      }
+    }
+
+    int64_t window = position + needle_length;
+    if (window > end) {
+      window = end;
+    }
+    int64_t found = text_rfind(chunk, window - start, needle, needle_length);
+    if (found >= 0) {
+      return start + found;
+    }
+    position = start - 1;
+  }
+  return -1;
+}
+
+// The line that the given offset is on.
+static int64_t doc_line_of(struct Document *doc, int64_t position) {
+  if (doc->kind == DOCUMENT_ROPE) {
+    return rope_line_of(&doc->rope, position);
+  }
+  return lines_line_of(&doc->lines, position);
+}
+
+// The offset where the given line starts, or -1 if there is no such line.
+static int64_t doc_line_start(struct Document *doc, int64_t line) {
+  if (doc->kind == DOCUMENT_ROPE) {
+    return rope_line_start(&doc->rope, line);
+  }
+  return lines_line_start(&doc->lines, line);
+}
+
+// Regular expressions are compiled to an NFA and matched with a DFA that is
+// built lazily, a state at a time, as the text needs it. Each byte of text
+// costs one table lookup once its state is built, and building a state is
+// bounded by the size of the pattern, so matching is linear in the text
+// with no backtracking. When the cache of states fills up it is thrown away
+// and rebuilt as needed.
+//
+// Matches are leftmost-longest. The forward DFA finds where the match ends:
+// its states keep the NFA threads grouped by where they started, earliest
+// first, so once one group matches we can drop every group that started
+// later. Then a DFA for the reversed pattern runs backwards from the end to
+// find the start.
+//
+// Supported: literals, ., [classes], \d \w \s and their negations, escapes,
+// * + ?, |, (groups), and ^ and $ at line boundaries.
+struct RegexSet {
+  uint32_t bits[8];
+};
+
+static int regex_set_has(const struct RegexSet *set, unsigned char c) {
+  return (set->bits[c >> 5] >> (c & 31)) & 1;
+}
+
+static void regex_set_add(struct RegexSet *set, unsigned char c) {
+  set->bits[c >> 5] |= 1u << (c & 31);
+}
+
+enum RegexKind {
+  REGEX_EMPTY,
+  REGEX_SET,
+  REGEX_BOL,
+  REGEX_EOL,
+  REGEX_CONCAT,
+  REGEX_ALT,
+  REGEX_STAR,
+  REGEX_PLUS,
+  REGEX_QUEST,
+};
+
+struct RegexAst {
+  enum RegexKind kind;
+  int left;
+  int right;
+  int set;
+};
+
+enum RegexOp {
+  REGEX_OP_SET,
+  REGEX_OP_SPLIT,
+  REGEX_OP_BOL,
+  REGEX_OP_EOL,
+  REGEX_OP_MATCH,
+};
+
+struct RegexNode {
+  enum RegexOp op;
+  int out;
+  int out1;
+  int set;
+};
+
+// Flags that are part of a state's identity...
+#define REGEX_STATE_BOL (1)     // Just after a newline, for ^.
+#define REGEX_STATE_MATCHED (2) // A match was found; stop starting threads.
+// ...and flags that follow from its contents.
+#define REGEX_STATE_MATCH (4)   // There's a match ending here.
+#define REGEX_STATE_DEAD (8)    // Nothing more can match.
+#define REGEX_STATE_HAS_EOL (16) // Waiting on a $.
+
+#define REGEX_STATE_KEY (REGEX_STATE_BOL | REGEX_STATE_MATCHED)
+
+// Separates the groups of threads in a state.
+#define REGEX_MARK (-1)
+
+#define REGEX_DFA_MAX_STATES (1024)
+#define REGEX_DFA_BUCKETS (2048)
+
+struct RegexState {
+  struct RegexState *next[256];
+
+  // This state with its $ assertions satisfied, for when a newline or the
+  // end of the text comes next.
+  struct RegexState *eol;
+
+  struct RegexState *chain;
+  unsigned hash;
+  int flags;
+  int count;
+  int nodes[];
+};
+
+struct RegexDfa {
+  struct RegexNode *nodes;
+  int node_count;
+  int start;
+  int unanchored;
+  const struct RegexSet *sets;
+
+  struct RegexState *buckets[REGEX_DFA_BUCKETS];
+  int state_count;
+  struct RegexState *starts[2];
+  int flushed;
+
+  // How many times the cache has filled up and been thrown away.
+  int64_t flushes;
+
+  // Scratch space for building states.
+  int *list;
+  int list_count;
+  int *stack;
+  int *seen;
+  int generation;
+};
+
+struct Regex {
+  struct RegexSet *sets;
+  int set_count;
+  int set_capacity;
+
+  struct RegexAst *ast;
+  int ast_count;
+  int ast_capacity;
+
+  struct RegexDfa forward;
+  struct RegexDfa reverse;
+
+  // Patterns that are just a string, which is most of them, skip the DFA and
+  // use the substring search.
+  char *literal;
+  int literal_length;
+};
+
+struct RegexParser {
+  struct Regex *regex;
+  const char *pattern;
+  int length;
+  int position;
+  const char *error;
+};
+
+static int regex_new_set(struct Regex *regex) {
+  if (regex->set_count == regex->set_capacity) {
+    regex->set_capacity = regex->set_capacity ? regex->set_capacity * 2 : 16;
+    regex->sets =
+        realloc(regex->sets, sizeof(struct RegexSet) * regex->set_capacity);
+    if (!regex->sets) {
+      die("Cannot grow regex");
+    }
+  }
+  memset(&regex->sets[regex->set_count], 0, sizeof(struct RegexSet));
+  return regex->set_count++;
+}
+
+static int regex_new_ast(struct Regex *regex, enum RegexKind kind, int left,
+                         int right, int set) {
+  if (regex->ast_count == regex->ast_capacity) {
+    regex->ast_capacity = regex->ast_capacity ? regex->ast_capacity * 2 : 32;
+    regex->ast =
+        realloc(regex->ast, sizeof(struct RegexAst) * regex->ast_capacity);
+    if (!regex->ast) {
+      die("Cannot grow regex");
+    }
+  }
+  struct RegexAst *ast = &regex->ast[regex->ast_count];
+  ast->kind = kind;
+  ast->left = left;
+  ast->right = right;
+  ast->set = set;
+  return regex->ast_count++;
+}
+
+static int regex_peek(struct RegexParser *parser) {
+  if (parser->position < parser->length) {
+    return (unsigned char)parser->pattern[parser->position];
+  }
+  return -1;
+}
+
+// Add the class for \d, \w or \s (or their negations) to the set. Returns 0
+// if the letter isn't one of those.
+static int regex_class_escape(struct RegexSet *set, char c) {
+  int lower = tolower((unsigned char)c);
+  if (lower != 'd' && lower != 'w' && lower != 's') {
+    return 0;
+  }
+  for (int i = 0; i < 256; i++) {
+    int in;
+    if (lower == 'd') {
+      in = isdigit(i);
+    } else if (lower == 'w') {
+      in = isalnum(i) || i == '_';
+    } else {
+      in = isspace(i);
+    }
+    if ((in != 0) != (c != lower)) {
+      regex_set_add(set, (unsigned char)i);
+    }
+  }
+  return 1;
+}
+
+static char regex_escape(char c) {
+  switch (c) {
+  case 'n':
+    return '\n';
+  case 't':
+    return '\t';
+  case 'r':
+    return '\r';
+  default:
+    return c;
+  }
+}
+
+static int regex_parse_class(struct RegexParser *parser) {
+  int index = regex_new_set(parser->regex);
+  struct RegexSet set;
+  memset(&set, 0, sizeof(set));
+
+  int negate = 0;
+  if (regex_peek(parser) == '^') {
+    negate = 1;
+    parser->position += 1;
+  }
+
+  int first = 1;
+  for (;;) {
+    int c = regex_peek(parser);
+    if (c < 0) {
+      parser->error = "Unterminated [";
+      return -1;
+    }
+    parser->position += 1;
+    if (c == ']' && !first) {
+      break;
+    }
+    first = 0;
+
+    if (c == '\\') {
+      c = regex_peek(parser);
+      if (c < 0) {
+        parser->error = "Trailing \\";
+        return -1;
+      }
+      parser->position += 1;
+      if (regex_class_escape(&set, (char)c)) {
+        continue;
+      }
+      c = (unsigned char)regex_escape((char)c);
+    }
+
+    int last = c;
+    if (regex_peek(parser) == '-' && parser->position + 1 < parser->length &&
+        parser->pattern[parser->position + 1] != ']') {
+      parser->position += 1;
+      last = regex_peek(parser);
+      parser->position += 1;
+      if (last == '\\' && regex_peek(parser) >= 0) {
+        last = (unsigned char)regex_escape((char)regex_peek(parser));
+        parser->position += 1;
+      }
+      if (last < c) {
+        parser->error = "Bad range in []";
+        return -1;
+      }
+    }
+    for (int i = c; i <= last; i++) {
+      regex_set_add(&set, (unsigned char)i);
+    }
+  }
+
+  if (negate) {
+    for (int i = 0; i < 8; i++) {
+      set.bits[i] = ~set.bits[i];
+    }
+  }
+  parser->regex->sets[index] = set;
+  return regex_new_ast(parser->regex, REGEX_SET, -1, -1, index);
+}
+
+static int regex_parse_alt(struct RegexParser *parser);
+
+static int regex_parse_atom(struct RegexParser *parser) {
+  struct Regex *regex = parser->regex;
+  int c = regex_peek(parser);
+  parser->position += 1;
+  switch (c) {
+  case '(': {
+    int inner = regex_parse_alt(parser);
+    if (inner < 0) {
+      return -1;
+    }
+    if (regex_peek(parser) != ')') {
+      parser->error = "Unmatched (";
+      return -1;
+    }
+    parser->position += 1;
+    return inner;
+  }
+  case '[':
+    return regex_parse_class(parser);
+  case '^':
+    return regex_new_ast(regex, REGEX_BOL, -1, -1, -1);
+  case '$':
+    return regex_new_ast(regex, REGEX_EOL, -1, -1, -1);
+  case '*':
+  case '+':
+  case '?':
+    parser->error = "Nothing to repeat";
+    return -1;
+  }
+
+  int set = regex_new_set(regex);
+  if (c == '.') {
+    for (int i = 0; i < 256; i++) {
+      if (i != '\n') {
+        regex_set_add(&regex->sets[set], (unsigned char)i);
+      }
+    }
+  } else if (c == '\\') {
+    c = regex_peek(parser);
+    if (c < 0) {
+      parser->error = "Trailing \\";
+      return -1;
+    }
+    parser->position += 1;
+    if (!regex_class_escape(&regex->sets[set], (char)c)) {
+      regex_set_add(&regex->sets[set], (unsigned char)regex_escape((char)c));
+    }
+  } else {
+    regex_set_add(&regex->sets[set], (unsigned char)c);
+  }
+  return regex_new_ast(regex, REGEX_SET, -1, -1, set);
+}
+
+static int regex_parse_repeat(struct RegexParser *parser) {
+  int atom = regex_parse_atom(parser);
+  for (;;) {
+    if (atom < 0) {
+      return -1;
+    }
+    int c = regex_peek(parser);
+    enum RegexKind kind;
+    if (c == '*') {
+      kind = REGEX_STAR;
+    } else if (c == '+') {
+      kind = REGEX_PLUS;
+    } else if (c == '?') {
+      kind = REGEX_QUEST;
+    } else {
+      return atom;
+    }
+    parser->position += 1;
+    atom = regex_new_ast(parser->regex, kind, atom, -1, -1);
+  }
+}
+
+static int regex_parse_concat(struct RegexParser *parser) {
+  int result = regex_new_ast(parser->regex, REGEX_EMPTY, -1, -1, -1);
+  for (;;) {
+    int c = regex_peek(parser);
+    if (c < 0 || c == '|' || c == ')') {
+      return result;
+    }
+    int next = regex_parse_repeat(parser);
+    if (next < 0) {
+      return -1;
+    }
+    result = regex_new_ast(parser->regex, REGEX_CONCAT, result, next, -1);
+  }
+}
+
+static int regex_parse_alt(struct RegexParser *parser) {
+  int result = regex_parse_concat(parser);
+  while (result >= 0 && regex_peek(parser) == '|') {
+    parser->position += 1;
+    int right = regex_parse_concat(parser);
+    if (right < 0) {
+      return -1;
+    }
+    result = regex_new_ast(parser->regex, REGEX_ALT, result, right, -1);
+  }
+  return result;
+}
+
+static int regex_new_node(struct RegexDfa *dfa, enum RegexOp op, int out,
+                          int out1, int set) {
+  struct RegexNode *node = &dfa->nodes[dfa->node_count];
+  node->op = op;
+  node->out = out;
+  node->out1 = out1;
+  node->set = set;
+  return dfa->node_count++;
+}
+
+// Compile the tree into NFA nodes that go on to next when they match. The
+// reversed program matches the pattern backwards, so concatenations run the
+// other way and ^ and $ trade places.
+static int regex_compile_ast(struct RegexDfa *dfa, const struct Regex *regex,
+                             int index, int next, int reverse) {
+  const struct RegexAst *ast = &regex->ast[index];
+  switch (ast->kind) {
+  case REGEX_EMPTY:
+    return next;
+  case REGEX_SET:
+    return regex_new_node(dfa, REGEX_OP_SET, next, -1, ast->set);
+  case REGEX_BOL:
+    return regex_new_node(dfa, reverse ? REGEX_OP_EOL : REGEX_OP_BOL, next,
+                          -1, -1);
+  case REGEX_EOL:
+    return regex_new_node(dfa, reverse ? REGEX_OP_BOL : REGEX_OP_EOL, next,
+                          -1, -1);
+  case REGEX_CONCAT:
+    if (reverse) {
+      return regex_compile_ast(
+          dfa, regex, ast->right,
+          regex_compile_ast(dfa, regex, ast->left, next, reverse), reverse);
+    }
+    return regex_compile_ast(
+        dfa, regex, ast->left,
+        regex_compile_ast(dfa, regex, ast->right, next, reverse), reverse);
+  case REGEX_ALT: {
+    int left = regex_compile_ast(dfa, regex, ast->left, next, reverse);
+    int right = regex_compile_ast(dfa, regex, ast->right, next, reverse);
+    return regex_new_node(dfa, REGEX_OP_SPLIT, left, right, -1);
+  }
+  case REGEX_STAR: {
+    int split = regex_new_node(dfa, REGEX_OP_SPLIT, -1, next, -1);
+    dfa->nodes[split].out =
+        regex_compile_ast(dfa, regex, ast->left, split, reverse);
+    return split;
+  }
+  case REGEX_PLUS: {
+    int split = regex_new_node(dfa, REGEX_OP_SPLIT, -1, next, -1);
+    int body = regex_compile_ast(dfa, regex, ast->left, split, reverse);
+    dfa->nodes[split].out = body;
+    return body;
+  }
+  case REGEX_QUEST: {
+    int body = regex_compile_ast(dfa, regex, ast->left, next, reverse);
+    return regex_new_node(dfa, REGEX_OP_SPLIT, body, next, -1);
+  }
+  }
+  return next;
+}
+
+static void regex_dfa_flush(struct RegexDfa *dfa) {
+  for (int i = 0; i < REGEX_DFA_BUCKETS; i++) {
+    struct RegexState *state = dfa->buckets[i];
+    while (state) {
+      struct RegexState *chain = state->chain;
+      free(state);
+      state = chain;
+    }
+    dfa->buckets[i] = NULL;
+  }
+  dfa->state_count = 0;
+  dfa->starts[0] = dfa->starts[1] = NULL;
+  dfa->flushed = 1;
+}
+
+static void regex_dfa_init(struct RegexDfa *dfa, const struct Regex *regex,
+                           int root, int unanchored, int reverse) {
+  // Every tree node makes at most one NFA node, plus one for the match.
+  dfa->nodes = malloc(sizeof(struct RegexNode) * (regex->ast_count + 1));
+  dfa->list = malloc(sizeof(int) * (regex->ast_count + 2) * 2);
+  dfa->stack = malloc(sizeof(int) * (regex->ast_count + 2) * 2);
+  dfa->seen = calloc(regex->ast_count + 1, sizeof(int));
+  if (!dfa->nodes || !dfa->list || !dfa->stack || !dfa->seen) {
+    die("Cannot allocate regex");
+  }
+  dfa->node_count = 0;
+  int match = regex_new_node(dfa, REGEX_OP_MATCH, -1, -1, -1);
+  dfa->start = regex_compile_ast(dfa, regex, root, match, reverse);
+  dfa->unanchored = unanchored;
+  dfa->sets = regex->sets;
+  dfa->generation = 0;
+  dfa->list_count = 0;
+  memset(dfa->buckets, 0, sizeof(dfa->buckets));
+  dfa->state_count = 0;
+  dfa->starts[0] = dfa->starts[1] = NULL;
+  dfa->flushes = 0;
+}
+
+static void regex_dfa_free(struct RegexDfa *dfa) {
+  regex_dfa_flush(dfa);
+  free(dfa->nodes);
+  free(dfa->list);
+  free(dfa->stack);
+  free(dfa->seen);
+  dfa->nodes = NULL;
+  dfa->list = dfa->stack = dfa->seen = NULL;
+}
+
+// Add everything reachable from the node without reading a byte to the
+// list. Nodes already in the state being built are skipped: a thread that
+// started earlier has already claimed them.
+static void regex_add(struct RegexDfa *dfa, int node, int bol, int eol) {
+  int depth = 0;
+  dfa->stack[depth++] = node;
+  while (depth) {
+    int n = dfa->stack[--depth];
+    if (dfa->seen[n] == dfa->generation) {
+      continue;
+    }
+    dfa->seen[n] = dfa->generation;
+
+    const struct RegexNode *nfa = &dfa->nodes[n];
+    switch (nfa->op) {
+    case REGEX_OP_SPLIT:
+      dfa->stack[depth++] = nfa->out1;
+      dfa->stack[depth++] = nfa->out;
+      break;
+    case REGEX_OP_BOL:
+      if (bol) {
+        dfa->stack[depth++] = nfa->out;
+      }
+      break;
+    case REGEX_OP_EOL:
+      dfa->list[dfa->list_count++] = n;
+      if (eol) {
+        dfa->stack[depth++] = nfa->out;
+      }
+      break;
+    case REGEX_OP_SET:
+    case REGEX_OP_MATCH:
+      dfa->list[dfa->list_count++] = n;
+      break;
+    }
+  }
+}
+
+static void regex_begin_group(struct RegexDfa *dfa) {
+  if (dfa->list_count && dfa->list[dfa->list_count - 1] != REGEX_MARK) {
+    dfa->list[dfa->list_count++] = REGEX_MARK;
+  }
+}
+
+// Turn the list into a state: work out its flags, keeping only the groups up
+// to the first one that matches, and find it in the cache or add it.
+static struct RegexState *regex_intern(struct RegexDfa *dfa, int flags,
+                                       int eol) {
+  if (dfa->list_count && dfa->list[dfa->list_count - 1] == REGEX_MARK) {
+    dfa->list_count -= 1;
+  }
+
+  flags &= REGEX_STATE_KEY;
+  for (int i = 0; i < dfa->list_count; i++) {
+    int n = dfa->list[i];
+    if (n == REGEX_MARK) {
+      if (flags & REGEX_STATE_MATCH) {
+        dfa->list_count = i;
+        break;
+      }
+    } else if (dfa->nodes[n].op == REGEX_OP_MATCH) {
+      flags |= REGEX_STATE_MATCH | REGEX_STATE_MATCHED;
+    }
+  }
+
+  unsigned hash = 2166136261u ^ (unsigned)flags;
+  for (int i = 0; i < dfa->list_count; i++) {
+    hash = (hash ^ (unsigned)dfa->list[i]) * 16777619u;
+  }
+  struct RegexState **bucket = &dfa->buckets[hash % REGEX_DFA_BUCKETS];
+  for (struct RegexState *state = *bucket; state; state = state->chain) {
+    if (state->hash == hash && (state->flags & REGEX_STATE_KEY) ==
+                                   (flags & REGEX_STATE_KEY) &&
+        state->count == dfa->list_count &&
+        memcmp(state->nodes, dfa->list, sizeof(int) * state->count) == 0) {
+      return state;
+    }
+  }
+
+  if (dfa->state_count == REGEX_DFA_MAX_STATES) {
+    regex_dfa_flush(dfa);
+    dfa->flushes += 1;
+    bucket = &dfa->buckets[hash % REGEX_DFA_BUCKETS];
+  }
+
+  for (int i = 0; i < dfa->list_count; i++) {
+    int n = dfa->list[i];
+    if (!eol && n != REGEX_MARK && dfa->nodes[n].op == REGEX_OP_EOL) {
+      flags |= REGEX_STATE_HAS_EOL;
+    }
+  }
+  if (dfa->list_count == 0 &&
+      (!dfa->unanchored || (flags & REGEX_STATE_MATCHED))) {
+    flags |= REGEX_STATE_DEAD;
+  }
+
+  struct RegexState *state =
+      calloc(1, sizeof(struct RegexState) + sizeof(int) * dfa->list_count);
+  if (!state) {
+    die("Cannot allocate regex state");
+  }
+  state->hash = hash;
+  state->flags = flags;
+  state->count = dfa->list_count;
+  memcpy(state->nodes, dfa->list, sizeof(int) * state->count);
+  state->chain = *bucket;
+  *bucket = state;
+  dfa->state_count += 1;
+  return state;
+}
+
+static struct RegexState *regex_start(struct RegexDfa *dfa, int bol) {
+  if (!dfa->starts[bol]) {
+    dfa->generation += 1;
+    dfa->list_count = 0;
+    regex_add(dfa, dfa->start, bol, 0);
+    dfa->flushed = 0;
+    dfa->starts[bol] = regex_intern(dfa, bol ? REGEX_STATE_BOL : 0, 0);
+  }
+  return dfa->starts[bol];
+}
+
+// The state with its $ assertions satisfied. Call this before stepping over
+// a newline, and at the end of the text.
+static struct RegexState *regex_eol(struct RegexDfa *dfa,
+                                   struct RegexState *state) {
+  if (state->eol) {
+    return state->eol;
+  }
+  if (!(state->flags & REGEX_STATE_HAS_EOL)) {
+    state->eol = state;
+    return state;
+  }
+
+  dfa->generation += 1;
+  dfa->list_count = 0;
+  for (int i = 0; i < state->count; i++) {
+    int n = state->nodes[i];
+    if (n == REGEX_MARK) {
+      regex_begin_group(dfa);
+    } else {
+      regex_add(dfa, n, state->flags & REGEX_STATE_BOL, 1);
+    }
+  }
+  dfa->flushed = 0;
+  struct RegexState *eol = regex_intern(dfa, state->flags, 1);
+  if (!dfa->flushed) {
+    state->eol = eol;
+  }
+  return eol;
+}
+
+static struct RegexState *regex_next(struct RegexDfa *dfa,
+                                    struct RegexState *state,
+                                    unsigned char c) {
+  struct RegexState *next = state->next[c];
+  if (next) {
+    return next;
+  }
+
+  int bol = c == '\n';
+  dfa->generation += 1;
+  dfa->list_count = 0;
+  for (int i = 0; i < state->count; i++) {
+    int n = state->nodes[i];
+    if (n == REGEX_MARK) {
+      regex_begin_group(dfa);
+    } else if (dfa->nodes[n].op == REGEX_OP_SET &&
+               regex_set_has(&dfa->sets[dfa->nodes[n].set], c)) {
+      regex_add(dfa, dfa->nodes[n].out, bol, 0);
+    }
+  }
+  if (dfa->unanchored && !(state->flags & REGEX_STATE_MATCHED)) {
+    regex_begin_group(dfa);
+    regex_add(dfa, dfa->start, bol, 0);
+  }
+
+  int flags = (state->flags & REGEX_STATE_MATCHED) |
+              (bol ? REGEX_STATE_BOL : 0);
+  dfa->flushed = 0;
+  next = regex_intern(dfa, flags, 0);
+  if (!dfa->flushed) {
+    state->next[c] = next;
+  }
+  return next;
+}
+
+// Append the string the AST matches to the regex's literal, if it only
+// matches one. Returns 0 if it doesn't.
+static int regex_literal(struct Regex *regex, int index) {
+  struct RegexAst *ast = &regex->ast[index];
+  switch (ast->kind) {
+  case REGEX_EMPTY:
+    return 1;
+  case REGEX_CONCAT:
+    return regex_literal(regex, ast->left) &&
+           regex_literal(regex, ast->right);
+  case REGEX_SET: {
+    int found = -1;
+    for (int c = 0; c < 256; c++) {
+      if (regex_set_has(&regex->sets[ast->set], (unsigned char)c)) {
+        if (found >= 0) {
+          return 0;
+        }
+        found = c;
+      }
+    }
+    if (found < 0) {
+      // An empty set, like [^\d\D], matches nothing at all.
+      return 0;
+    }
+    regex->literal[regex->literal_length++] = (char)found;
+    return 1;
+  }
+  default:
+    return 0;
+  }
+}
+
+// Compile the pattern. Returns NULL, or a message saying what's wrong with
+// it.
+static const char *regex_compile(struct Regex *regex, const char *pattern,
+                                 int length) {
+  memset(regex, 0, sizeof(*regex));
+  struct RegexParser parser = {regex, pattern, length, 0, NULL};
+  int root = regex_parse_alt(&parser);
+  if (root >= 0 && parser.position < length) {
+    parser.error = "Unmatched )";
+  }
+  if (parser.error) {
+    free(regex->sets);
+    free(regex->ast);
+    memset(regex, 0, sizeof(*regex));
+    return parser.error;
+  }
+
+  regex_dfa_init(&regex->forward, regex, root, 1, 0);
+  regex_dfa_init(&regex->reverse, regex, root, 0, 1);
+
+  // A literal is never longer than the pattern.
+  regex->literal = malloc(length + 1);
+  if (!regex->literal) {
+    die("Cannot allocate regex");
+  }
+  if (!regex_literal(regex, root) || regex->literal_length == 0) {
+    free(regex->literal);
+    regex->literal = NULL;
+    regex->literal_length = 0;
+  }
+
+  free(regex->ast);
+  regex->ast = NULL;
+  regex->ast_count = regex->ast_capacity = 0;
+  return NULL;
+}
+
+static void regex_free(struct Regex *regex) {
+  if (regex->forward.nodes) {
+    regex_dfa_free(&regex->forward);
+    regex_dfa_free(&regex->reverse);
+  }
+  free(regex->sets);
+  free(regex->ast);
+  free(regex->literal);
+  memset(regex, 0, sizeof(*regex));
+}
+
+// Find the leftmost-longest match starting at or after the position. The
+// document is read a chunk at a time, in place.
+static int regex_search(struct Regex *regex, struct Document *doc,
+                        int64_t from, int64_t *match_start,
+                        int64_t *match_end) {
+  int64_t total = doc_length(doc);
+  if (from < 0 || from > total) {
+    return 0;
+  }
+
+  if (regex->literal) {
+    int64_t found =
+        doc_search(doc, regex->literal, regex->literal_length, from);
+    if (found < 0) {
+      return 0;
+    }
+    *match_start = found;
+    *match_end = found + regex->literal_length;
+    return 1;
+  }
+
+  struct RegexDfa *dfa = &regex->forward;
+  int bol = from == 0 || doc_at(doc, from - 1) == '\n';
+  struct RegexState *state = regex_start(dfa, bol);
+  int64_t position = from;
+  int64_t end = -1;
+  while (position < total) {
+    int64_t start;
+    int64_t length;
+    const char *chunk = doc_chunk(doc, position, &start, &length);
+    int64_t i = position - start;
+    for (; i < length && !(state->flags & REGEX_STATE_DEAD); i++) {
+      unsigned char c = (unsigned char)chunk[i];
+      if (c == '\n') {
+        state = regex_eol(dfa, state);
+      }
+      if (state->flags & REGEX_STATE_MATCH) {
+        end = start + i;
+      }
+      state = regex_next(dfa, state, c);
+    }
+    position = start + i;
+    if (state->flags & REGEX_STATE_DEAD) {
+      break;
+    }
+  }
+  if (position == total) {
+    state = regex_eol(dfa, state);
+    if (state->flags & REGEX_STATE_MATCH) {
+      end = total;
+    }
+  }
+  if (end < 0) {
+    return 0;
+  }
+
+  // Now back from the end for the longest match that finishes there. There
+  // is one, and it starts at or after where we started looking.
+  dfa = &regex->reverse;
+  bol = end == total || doc_at(doc, end) == '\n';
+  state = regex_start(dfa, bol);
+  position = end;
+  *match_start = -1;
+  while (position > from) {
+    int64_t start;
+    int64_t length;
+    const char *chunk = doc_chunk(doc, position - 1, &start, &length);
+    int64_t stop = from > start ? from - start : 0;
+    int64_t i = position - 1 - start;
+    for (; i >= stop && !(state->flags & REGEX_STATE_DEAD); i--) {
+      unsigned char c = (unsigned char)chunk[i];
+      if (c == '\n') {
+        state = regex_eol(dfa, state);
+      }
+      if (state->flags & REGEX_STATE_MATCH) {
+        *match_start = start + i + 1;
+      }
+      state = regex_next(dfa, state, c);
+    }
+    position = start + i + 1;
+    if (state->flags & REGEX_STATE_DEAD) {
+      break;
+    }
+  }
+  if (position == from) {
+    if (from == 0 || doc_at(doc, from - 1) == '\n') {
+      state = regex_eol(dfa, state);
+    }
+    if (state->flags & REGEX_STATE_MATCH) {
+      *match_start = from;
+    }
+  }
+  *match_end = end;
+  return 1;
+}
+
+// Find every match of the pattern in each file, the way replacing them all
+// would, and print how fast that went and how often the DFAs had to start
+// again from an empty cache. Run with "nib --bench-regex pattern files...".
+static void regex_bench(const char *pattern, char **files, int count) {
+  struct Regex regex;
+  const char *error = regex_compile(&regex, pattern, (int)strlen(pattern));
+  if (error) {
+    fprintf(stderr, "%s\n", error);
+    exit(1);
+  }
+  printf("/%s/%s\n", pattern, regex.literal ? ", a literal" : "");
+
+  int64_t total_bytes = 0;
+  int64_t total_us = 0;
+  for (int i = 0; i < count; i++) {
+    struct Buffer text;
+    buffer_init(&text);
+    if (buffer_append_file(&text, files[i])) {
+      die(files[i]);
+    }
+    struct Document doc;
+    doc_init(&doc, DOCUMENT_GAP);
+    doc_load(&doc, doc_kind_for(text.length), &text);
+    buffer_free(&text);
+
+    int64_t length = doc_length(&doc);
+    int64_t flushes = regex.forward.flushes + regex.reverse.flushes;
+    int64_t matches = 0;
+    int64_t from = 0;
+    int64_t start;
+    int64_t end;
+    int64_t start_us = clock_us();
+    while (from <= length && regex_search(&regex, &doc, from, &start, &end)) {
+      matches += 1;
+      from = end == start ? end + 1 : end;
+    }
+    int64_t elapsed_us = clock_us() - start_us;
+    flushes = regex.forward.flushes + regex.reverse.flushes - flushes;
+
+    printf("%s: %lld MB, %lld matches, %.0f MB/s, %lld flushes\n", files[i],
+           (long long)(length >> 20), (long long)matches,
+           (double)length / (double)(elapsed_us ? elapsed_us : 1),
+           (long long)flushes);
+    total_bytes += length;
+    total_us += elapsed_us;
+    doc_free(&doc);
+  }
+  if (count > 1) {
+    printf("all: %lld MB, %.0f MB/s, %lld flushes\n",
+           (long long)(total_bytes >> 20),
+           (double)total_bytes / (double)(total_us ? total_us : 1),
+           (long long)(regex.forward.flushes + regex.reverse.flushes));
+  }
+  regex_free(&regex);
+}
+
+// Patterns run over a text, with the first match each should find (-1 for
+// none). Run with "nib --check-regex"; each one that goes wrong is printed.
+static const struct RegexCheck {
+  const char *pattern;
+  const char *text;
+  int start;
+  int end;
+} regex_checks[] = {
+    {"b", "ab\xff" "b", 1, 2},
+    {"\\d+", "ab12c", 2, 4},
+    {"a|ab", "xab", 1, 3},
+    {"[^a]b", "ab\xff" "b", 2, 4},
+    {"[^\\d\\D]", "ab\xff" "b", -1, -1},
+    {"[^\\w\\W]", "ab\xff" "b", -1, -1},
+    {"[^\\s\\S]x", "\xff" "x", -1, -1},
+};
+
+static int regex_check(void) {
+  int failures = 0;
+  int count = (int)(sizeof(regex_checks) / sizeof(regex_checks[0]));
+  for (int i = 0; i < count; i++) {
+    const struct RegexCheck *check = &regex_checks[i];
+    struct Regex regex;
+    const char *error =
+        regex_compile(&regex, check->pattern, (int)strlen(check->pattern));
+    if (error) {
+      printf("/%s/: %s\n", check->pattern, error);
+      failures += 1;
+      continue;
+    }
+    struct Buffer text;
+    buffer_init(&text);
+    buffer_append(&text, check->text, (int)strlen(check->text));
+    struct Document doc;
+    doc_init(&doc, DOCUMENT_GAP);
+    doc_load(&doc, DOCUMENT_GAP, &text);
+    buffer_free(&text);
+
+    int64_t start = -1;
+    int64_t end = -1;
+    if (!regex_search(&regex, &doc, 0, &start, &end)) {
+      start = end = -1;
+    }
+    if (start != check->start || end != check->end) {
+      printf("/%s/: matched %lld to %lld, not %d to %d\n", check->pattern,
+             (long long)start, (long long)end, check->start, check->end);
+      failures += 1;
+    }
+    doc_free(&doc);
+    regex_free(&regex);
+  }
+  printf("%d of %d regex checks failed\n", failures, count);
+  return failures;
+}
+
+// The undo log is a list of edit records, with the bytes each one inserted
+// or erased kept back to back in an arena. Records are grouped into
+// transactions, each of which is undone or redone as a whole.
+enum UndoKind {
+  UNDO_INSERT,
+  UNDO_ERASE,
+  UNDO_REPLACE_ALL,
+};
+
+// A replace-all is one record starting at the first match. Its bytes in the
+// arena are the replacement and the number of matches, then for each match
+// how far it starts from the end of the one before, its length, and what it
+// was. Lengths and counts are varints.
+struct UndoRecord {
+  enum UndoKind kind;
+  int64_t position;
+  int64_t length; // Bytes in the arena.
+  int data; // Where the bytes start in the arena.
+
+  // Set on the first record of a transaction, along with where the cursor
+  // was before it.
+  int group;
+  int64_t cursor;
+};
+
+struct UndoLog {
+  struct UndoRecord *records;
+  int count;
+  int capacity;
+
+  // Records before this one have been done; the ones from here on have been
+  // undone and can be redone.
+  int current;
+
+  struct Buffer arena;
+
+  // Roughly how many bytes the log may hold. The newest transaction is
+  // always kept, however big it is.
+  int64_t limit;
+
+  // Whether the next edit joins the newest transaction.
+  int open;
+};
+
+static void undo_init(struct UndoLog *log, int64_t limit) {
+  log->records = NULL;
+  log->count = 0;
+  log->capacity = 0;
+  log->current = 0;
+  buffer_init(&log->arena);
+  log->limit = limit;
+  log->open = 0;
+}
+
+static void undo_free(struct UndoLog *log) {
+  free(log->records);
+  log->records = NULL;
+  log->count = log->capacity = log->current = 0;
+  buffer_free(&log->arena);
+}
+
+static void undo_clear(struct UndoLog *log) {
+  log->count = log->current = 0;
+  buffer_clear(&log->arena);
+  log->open = 0;
+}
+
+// Start a new transaction with the next edit.
+static void undo_boundary(struct UndoLog *log) { log->open = 0; }
+
+static int64_t undo_size(struct UndoLog *log) {
+  return log->arena.length +
+         (int64_t)log->count * (int64_t)sizeof(struct UndoRecord);
+}
+
+// Drop the oldest transactions until the log is comfortably under its
+// limit, so that a full log doesn't shuffle the arena on every edit.
+static void undo_trim(struct UndoLog *log) {
+  if (undo_size(log) <= log->limit) {
+    return;
+  }
+
+  int newest = log->count - 1;
+  while (newest > 0 && !log->records[newest].group) {
+    newest -= 1;
+  }
+
+  int64_t target = log->limit / 4 * 3;
+  int drop = 0;
+  int next = 0;
+  while (next < newest) {
+    next += 1;
+    while (next < newest && !log->records[next].group) {
+      next += 1;
+    }
+    drop = next;
+    int64_t bytes = log->arena.length - log->records[drop].data;
+    bytes += (int64_t)(log->count - drop) * (int64_t)sizeof(struct UndoRecord);
+    if (bytes <= target) {
+      break;
+    }
+  }
+  if (drop == 0) {
+    return;
+  }
+
+  int dropped_bytes = log->records[drop].data;
+  buffer_erase(&log->arena, 0, dropped_bytes);
+  memmove(log->records, log->records + drop,
+          sizeof(struct UndoRecord) * (log->count - drop));
+  log->count -= drop;
+  log->current -= drop;
+  for (int i = 0; i < log->count; i++) {
+    log->records[i].data -= dropped_bytes;
+  }
+}
+
+// Add a record, forgetting anything that could have been redone. The caller
+// appends the bytes to the arena.
+static struct UndoRecord *undo_push(struct UndoLog *log, enum UndoKind kind,
+                                    int64_t position, int64_t cursor) {
+  if (log->current < log->count) {
+    log->arena.length = log->records[log->current].data;
+    log->count = log->current;
+  }
+
+  if (log->count == log->capacity) {
+    log->capacity = log->capacity ? log->capacity * 2 : 64;
+    log->records =
+        realloc(log->records, sizeof(struct UndoRecord) * log->capacity);
+    if (!log->records) {
+      die("Cannot grow undo log");
+    }
+  }
+
+  struct UndoRecord *record = &log->records[log->count];
+  record->kind = kind;
+  record->position = position;
+  record->length = 0;
+  record->data = log->arena.length;
+  record->group = !log->open;
+  record->cursor = cursor;
+  log->count += 1;
+  log->current = log->count;
+  log->open = 1;
+  return record;
+}
+
+// Empty edits aren't worth a record. Edits too big for the arena can't be
+// undone, and neither can anything before them.
+static int undo_fits(struct UndoLog *log, int64_t length) {
+  if (length <= 0) {
+    return 0;
+  }
+  if (length > INT_MAX / 2 - log->arena.length) {
+    undo_clear(log);
+    return 0;
+  }
+  return 1;
+}
+
+static void undo_insert(struct UndoLog *log, int64_t position,
+                        const char *data, int64_t length, int64_t cursor) {
+  if (!undo_fits(log, length)) {
+    return;
+  }
+
+  // Typing straight on from the last insert just extends it.
+  struct UndoRecord *last =
+      log->count ? &log->records[log->count - 1] : NULL;
+  if (log->open && log->current == log->count && last &&
+      last->kind == UNDO_INSERT &&
+      last->position + last->length == position) {
+    buffer_append(&log->arena, data, (int)length);
+    last->length += length;
+  } else {
+    struct UndoRecord *record =
+        undo_push(log, UNDO_INSERT, position, cursor);
+    buffer_append(&log->arena, data, (int)length);
+    record->length = length;
+  }
+  undo_trim(log);
+}
+
+// Call before the bytes are erased, so they can be saved.
+static void undo_erase(struct UndoLog *log, struct Document *doc,
+                       int64_t position, int64_t length, int64_t cursor) {
+  if (!undo_fits(log, length)) {
+    return;
+  }
+
+  struct UndoRecord *record = undo_push(log, UNDO_ERASE, position, cursor);
+  doc_copy(doc, position, length, &log->arena);
+  record->length = length;
+  undo_trim(log);
+}
+
+static int undo_varint_length(uint64_t value) {
+  int length = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    length += 1;
+  }
+  return length;
+}
+
+static void undo_append_varint(struct Buffer *arena, uint64_t value) {
+  char bytes[10];
+  int length = 0;
+  while (value >= 0x80) {
+    bytes[length++] = (char)((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  bytes[length++] = (char)value;
+  buffer_append(arena, bytes, length);
+}
+
+static int64_t undo_read_varint(const char **data) {
+  uint64_t value = 0;
+  int shift = 0;
+  unsigned char byte;
+  do {
+    byte = (unsigned char)*(*data)++;
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  return (int64_t)value;
+}
+
+// Record replacing each of count matches (start and end pairs) with data,
+// as a transaction of its own. Call before the document changes. The record
+// takes about as much room as the matched text, however far apart the
+// matches are. Returns 0 if it's too big to keep, in which case nothing
+// before it can be undone either.
+static int undo_replace_all(struct UndoLog *log, struct Document *doc,
+                            const int64_t *matches, int64_t count,
+                            const char *data, int64_t data_length,
+                            int64_t cursor) {
+  int64_t size = undo_varint_length(data_length) + data_length +
+                 undo_varint_length(count);
+  int64_t end = matches[0];
+  for (int64_t i = 0; i < count; i++) {
+    int64_t start = matches[i * 2];
+    int64_t length = matches[i * 2 + 1] - start;
+    size += undo_varint_length(start - end) + undo_varint_length(length) +
+            length;
+    end = start + length;
+  }
+  if (!undo_fits(log, size)) {
+    return 0;
+  }
+
+  undo_boundary(log);
+  struct UndoRecord *record =
+      undo_push(log, UNDO_REPLACE_ALL, matches[0], cursor);
+  undo_append_varint(&log->arena, data_length);
+  buffer_append(&log->arena, data, (int)data_length);
+  undo_append_varint(&log->arena, count);
+  end = matches[0];
+  for (int64_t i = 0; i < count; i++) {
+    int64_t start = matches[i * 2];
+    int64_t length = matches[i * 2 + 1] - start;
+    undo_append_varint(&log->arena, start - end);
+    undo_append_varint(&log->arena, length);
+    doc_copy(doc, start, length, &log->arena);
+    end = start + length;
+  }
+  record->length = size;
+  undo_boundary(log);
+  undo_trim(log);
+  return 1;
+}
+
+// Do a replace-all again, or undo it, building the new text in one pass
+// like the replace-all itself did.
+static void undo_apply_replace_all(struct UndoLog *log, struct Document *doc,
+                                   struct UndoRecord *record, int reverse) {
+  const char *data = log->arena.memory + record->data;
+  int64_t data_length = undo_read_varint(&data);
+  const char *replacement = data;
+  data += data_length;
+  int64_t count = undo_read_varint(&data);
+  const char *matches = data;
+
+  int64_t length = doc_length(doc);
+  int64_t new_length = length;
+  for (int64_t i = 0; i < count; i++) {
+    undo_read_varint(&data);
+    int64_t old_length = undo_read_varint(&data);
+    data += old_length;
+    new_length += reverse ? old_length - data_length : data_length - old_length;
+  }
+  char *text = malloc(new_length ? new_length : 1);
+  if (!text) {
+    die("Cannot allocate document");
+  }
+
+  // Positions in the document as it is, and in the new text.
+  int64_t from = record->position;
+  int64_t to = record->position;
+  doc_read(doc, 0, from, text);
+  data = matches;
+  for (int64_t i = 0; i < count; i++) {
+    int64_t gap = undo_read_varint(&data);
+    int64_t old_length = undo_read_varint(&data);
+    doc_read(doc, from, gap, text + to);
+    from += gap;
+    to += gap;
+    if (reverse) {
+      memcpy(text + to, data, old_length);
+      to += old_length;
+      from += data_length;
+    } else {
+      memcpy(text + to, replacement, data_length);
+      to += data_length;
+      from += old_length;
+    }
+    data += old_length;
+  }
+  doc_read(doc, from, length - from, text + to);
+  doc_load_memory(doc, doc->kind, text, new_length, new_length);
+}
+
+static void undo_apply(struct UndoLog *log, struct Document *doc,
+                       struct UndoRecord *record, int reverse) {
+  if (record->kind == UNDO_REPLACE_ALL) {
+    undo_apply_replace_all(log, doc, record, reverse);
+  } else if ((record->kind == UNDO_INSERT) != reverse) {
+    doc_insert(doc, record->position, log->arena.memory + record->data,
+               record->length);
+  } else {
+    doc_erase(doc, record->position, record->length);
+  }
+}
+
+// Undo the last transaction, leaving the cursor where it was before it.
+// Returns 0 if there is nothing to undo.
+static int undo_undo(struct UndoLog *log, struct Document *doc,
+                     int64_t *cursor) {
+  if (log->current == 0) {
+    return 0;
+  }
+
+  struct UndoRecord *record;
+  do {
+    log->current -= 1;
+    record = &log->records[log->current];
+    undo_apply(log, doc, record, 1);
+  } while (!record->group);
+
+  *cursor = record->cursor;
+  log->open = 0;
+  return 1;
+}
+
+// Redo the next transaction, leaving the cursor after its last edit.
+// Returns 0 if there is nothing to redo.
+static int undo_redo(struct UndoLog *log, struct Document *doc,
+                     int64_t *cursor) {
+  if (log->current == log->count) {
+    return 0;
+  }
+
+  struct UndoRecord *record;
+  do {
+    record = &log->records[log->current];
+    undo_apply(log, doc, record, 0);
+    log->current += 1;
+  } while (log->current < log->count && !log->records[log->current].group);
+
+  *cursor = record->position;
+  if (record->kind == UNDO_INSERT) {
+    *cursor += record->length;
+  }
+  log->open = 0;
+  return 1;
+}
+
+// Input is read in bursts into a ring buffer, and decoded from there. Must
+// be a power of two.
+#define TERM_INPUT_RING_SIZE (4096)
+
+// How many parameters of a CSI sequence we keep; any more are read and
+// dropped.
+#define TERM_MAX_PARAMS (4)
+
+#define TERM_SYNCHRONIZED_MODE (2026)
+
+// Where frames go and keys come from: a real terminal, or a screen in
+// memory fed from a buffer of keys, for timing frames and checking what
+// they show without a tty.
+enum TermKind {
+  TERM_TTY,
+  TERM_HEADLESS,
+};
+
+// The headless terminal's screen. It understands the escape sequences
+// term_draw sends, and counts anything else.
+struct TermScreen {
+  int rows;
+  int columns;
+  char *cells;
+  int row;
+  int column;
+
+  // Printing in the last column leaves the cursor there; the next character
+  // goes at the start of the next line.
+  int wrap_pending;
+
+  // The scroll region, and the last character printed, for REP.
+  int top;
+  int bottom;
+  char last;
+
+  // The escape sequence being read.
+  int state;
+  int params[TERM_MAX_PARAMS];
+  int count;
+  char marker;
+  char intermediate;
+
+  int64_t bytes;
+  int64_t unknown;
+
+  // Answers to the queries the screen has been sent, for the terminal to
+  // read as input.
+  struct Buffer replies;
+
+  // The keys, and how many of them the terminal has read.
+  struct Buffer input;
+  int input_read;
+};
+
+struct Terminal {
+  enum TermKind kind;
+  struct TermScreen *screen;
+  struct termios original_mode;
+  struct Buffer buffer;
+  int input_fileno;
+  int output_fileno;
+  int rows;
+  int columns;
+
+  // The screen is drawn into `back`; `front` is what we believe the terminal
+  // is showing right now. term_draw sends only the cells that differ.
+  char *front;
+  char *back;
+  int clear_pending;
+
+  // SIGWINCH writes a byte down this pipe, so a resize wakes term_poll like
+  // input does. However many bytes are waiting, they make one resize.
+  int resize_pipe[2];
+  int resize_pending;
+
+  // Where term_write puts text in the back grid, and where the cursor should
+  // be left once the frame is drawn.
+  int draw_row;
+  int draw_column;
+  int cursor_row;
+  int cursor_column;
+
+  // Where the terminal's cursor actually is, or -1 if we don't know.
+  int screen_row;
+  int screen_column;
+
+  // Whether the terminal understands REP, which repeats the last character
+  // printed. Plenty don't (GNU screen, tmux, the Linux console), and then
+  // the repeated characters go missing, so it is off until the device
+  // attributes say the terminal is at least a VT220, unless the
+  // terminal-repeat property has settled it.
+  int repeat;
+  int repeat_settled;
+
+  // Whether the terminal can hold off showing a frame until all of it has
+  // arrived (DEC mode 2026). We ask at startup, and don't use it until the
+  // terminal says yes.
+  int synchronized;
+
+  // How many bytes the last frame took to send, and all of them so far. Over
+  // a slow link this is most of what decides how quick nib feels.
+  int frame_bytes;
+  int64_t total_bytes;
+  int64_t frames;
+
+  // How long term_draw took over the last frame, sending included, and over
+  // all of them.
+  int64_t frame_us;
+  int64_t total_us;
+
+  // When input was last read, which is where a key's latency starts.
+  int64_t read_us;
+
+  // Bytes read but not yet decoded. The counters only go up; masking them
+  // gives the index into the ring.
+  unsigned input_ring_read;
+  unsigned input_ring_write;
+  char input_ring[TERM_INPUT_RING_SIZE];
+
+  // The text of the last bracketed paste.
+  struct Buffer paste;
+};
+
+static struct Terminal *global_terminal = NULL;
+
+static void term_atexit(void);
+
+enum TermScreenState {
+  TERM_SCREEN_TEXT,
+  TERM_SCREEN_ESCAPE,
+  TERM_SCREEN_CSI,
+};
+
+static void term_screen_init(struct TermScreen *screen, int rows, int columns,
+                             const char *input, int length) {
+  screen->rows = rows;
+  screen->columns = columns;
+  screen->cells = malloc(rows * columns);
+  if (!screen->cells) {
+    die("Cannot allocate screen");
+  }
+  memset(screen->cells, ' ', rows * columns);
+  screen->row = 0;
+  screen->column = 0;
+  screen->wrap_pending = 0;
+  screen->top = 0;
+  screen->bottom = rows - 1;
+  screen->last = ' ';
+  screen->state = TERM_SCREEN_TEXT;
+  screen->bytes = 0;
+  screen->unknown = 0;
+  buffer_init(&screen->replies);
+  buffer_init(&screen->input);
+  buffer_append(&screen->input, input, length);
+  screen->input_read = 0;
+}
+
+static void term_screen_free(struct TermScreen *screen) {
+  free(screen->cells);
+  screen->cells = NULL;
+  buffer_free(&screen->replies);
+  buffer_free(&screen->input);
+}
+
+// Scroll the region up by count lines, or down if count is negative.
+static void term_screen_scroll(struct TermScreen *screen, int count) {
+  int columns = screen->columns;
+  int height = screen->bottom - screen->top + 1;
+  char *region = screen->cells + screen->top * columns;
+  if (count >= height || -count >= height) {
+    memset(region, ' ', height * columns);
+  } else if (count > 0) {
+    memmove(region, region + count * columns, (height - count) * columns);
+    memset(region + (height - count) * columns, ' ', count * columns);
+  } else if (count < 0) {
+    memmove(region - count * columns, region, (height + count) * columns);
+    memset(region, ' ', -count * columns);
+  }
+}
+
+static void term_screen_line_feed(struct TermScreen *screen) {
+  screen->wrap_pending = 0;
+  if (screen->row == screen->bottom) {
+    term_screen_scroll(screen, 1);
+  } else if (screen->row < screen->rows - 1) {
+    screen->row += 1;
+  }
+}
+
+static void term_screen_print(struct TermScreen *screen, char c) {
+  if (screen->wrap_pending) {
+    screen->column = 0;
+    term_screen_line_feed(screen);
+  }
+  screen->cells[screen->row * screen->columns + screen->column] = c;
+  screen->last = c;
+  if (screen->column == screen->columns - 1) {
+    screen->wrap_pending = 1;
+  } else {
+    screen->column += 1;
+  }
+}
+
+static int term_screen_clamp(int value, int limit) {
+  if (value < 0) {
+    return 0;
+  }
+  return value < limit ? value : limit - 1;
+}
+
+// Run a CSI sequence that has just ended with `final`.
+static void term_screen_csi(struct TermScreen *screen, char final) {
+  int *params = screen->params;
+  int count = screen->count;
+  // Missing parameters, and zeros, mean 1 to most sequences.
+  int first = count > 0 && params[0] > 0 ? params[0] : 1;
+  int second = count > 1 && params[1] > 0 ? params[1] : 0;
+
+  if (screen->marker == '?' && count == 1) {
+    int mode = params[0];
+    if (final == 'p' && screen->intermediate == '$' &&
+        mode == TERM_SYNCHRONIZED_MODE) {
+      // Synchronized updates are supported, and turned off.
+      const char *reply = "\x1b[?2026;2$y";
+      buffer_append(&screen->replies, reply, strlen(reply));
+      return;
+    }
+    // Showing the cursor, bracketed paste, and synchronized updates only
+    // change how the screen looks while it's being drawn.
+    if ((final == 'h' || final == 'l') && !screen->intermediate &&
+        (mode == 25 || mode == 2004 || mode == TERM_SYNCHRONIZED_MODE)) {
+      return;
+    }
+  }
+  if (final == 'c' && !screen->marker && !screen->intermediate &&
+      (count == 0 || params[0] == 0)) {
+    // Primary device attributes: a VT220, which knows REP.
+    const char *reply = "\x1b[?62c";
+    buffer_append(&screen->replies, reply, strlen(reply));
+    return;
+  }
+  if (screen->marker || screen->intermediate) {
+    screen->unknown += 1;
+    return;
+  }
+
+  int rows = screen->rows;
+  int columns = screen->columns;
+  char *line = screen->cells + screen->row * columns;
+  screen->wrap_pending = 0;
+  switch (final) {
+  case 'H': // Cursor position
+    screen->row = term_screen_clamp(first - 1, rows);
+    screen->column = term_screen_clamp((second ? second : 1) - 1, columns);
+    break;
+  case 'A': // Cursor up
+    screen->row = term_screen_clamp(screen->row - first, rows);
+    break;
+  case 'B': // Cursor down
+    screen->row = term_screen_clamp(screen->row + first, rows);
+    break;
+  case 'C': // Cursor forward
+    screen->column = term_screen_clamp(screen->column + first, columns);
+    break;
+  case 'D': // Cursor back
+    screen->column = term_screen_clamp(screen->column - first, columns);
+    break;
+  case 'K': // Erase to the end of the line
+    if (count > 0 && params[0] != 0) {
+      screen->unknown += 1;
+      break;
+    }
+    memset(line + screen->column, ' ', columns - screen->column);
+    break;
+  case 'X': // Erase characters
+    if (first > columns - screen->column) {
+      first = columns - screen->column;
+    }
+    memset(line + screen->column, ' ', first);
+    break;
+  case 'J': // Clear the screen
+    if (count != 1 || params[0] != 2) {
+      screen->unknown += 1;
+      break;
+    }
+    memset(screen->cells, ' ', rows * columns);
+    break;
+  case 'b': // Repeat the last character
+    for (int i = 0; i < first; i++) {
+      term_screen_print(screen, screen->last);
+    }
+    break;
+  case 'r': // Set the scroll region, and home the cursor
+    screen->top = first - 1;
+    screen->bottom = (second ? second : rows) - 1;
+    if (screen->top >= screen->bottom || screen->bottom >= rows) {
+      screen->top = 0;
+      screen->bottom = rows - 1;
+      screen->unknown += 1;
+    }
+    screen->row = 0;
+    screen->column = 0;
+    break;
+  case 'S': // Scroll up
+    term_screen_scroll(screen, first);
+    break;
+  case 'T': // Scroll down
+    term_screen_scroll(screen, -first);
+    break;
+  default:
+    screen->unknown += 1;
+    break;
+  }
+}
+
+static void term_screen_feed(struct TermScreen *screen, const char *data,
+                             int length) {
+  screen->bytes += length;
+  for (int i = 0; i < length; i++) {
+    unsigned char c = (unsigned char)data[i];
+    switch (screen->state) {
+    case TERM_SCREEN_TEXT:
+      if (c == '\x1b') {
+        screen->state = TERM_SCREEN_ESCAPE;
+      } else if (c == '\r') {
+        screen->column = 0;
+        screen->wrap_pending = 0;
+      } else if (c == '\n') {
+        term_screen_line_feed(screen);
+      } else if (c == '\b') {
+        screen->column -= screen->column > 0;
+        screen->wrap_pending = 0;
+      } else {
+        // Like the grids, the screen takes any other byte as one cell.
+        term_screen_print(screen, (char)c);
+      }
+      break;
+    case TERM_SCREEN_ESCAPE:
+      screen->state = TERM_SCREEN_TEXT;
+      if (c == '[') {
+        memset(screen->params, 0, sizeof(screen->params));
+        screen->count = 0;
+        screen->marker = 0;
+        screen->intermediate = 0;
+        screen->state = TERM_SCREEN_CSI;
+      } else if (c == 'M') {
+        // Reverse index: up a line, scrolling down at the top.
+        screen->wrap_pending = 0;
+        if (screen->row == screen->top) {
+          term_screen_scroll(screen, -1);
+        } else if (screen->row > 0) {
+          screen->row -= 1;
+        }
+      } else {
+        screen->unknown += 1;
+      }
+      break;
+    case TERM_SCREEN_CSI:
+      if (c >= '0' && c <= '9') {
+        if (screen->count == 0) {
+          screen->count = 1;
+        }
+        int *param = &screen->params[screen->count - 1];
+        if (*param < 100000) {
+          *param = *param * 10 + (c - '0');
+        }
+      } else if (c == ';') {
+        if (screen->count == 0) {
+          screen->count = 1;
+        }
+        if (screen->count < TERM_MAX_PARAMS) {
+          screen->count += 1;
+        }
+      } else if (c >= 0x3c && c <= 0x3f) {
+        screen->marker = (char)c;
+      } else if (c >= 0x20 && c <= 0x2f) {
+        screen->intermediate = (char)c;
+      } else {
+        if (c >= 0x40 && c <= 0x7e) {
+          term_screen_csi(screen, (char)c);
+        } else {
+          screen->unknown += 1;
+        }
+        screen->state = TERM_SCREEN_TEXT;
+      }
+      break;
+    }
+  }
+}
+
+// Mix what the screen shows, cursor included, into an FNV-1a hash.
+static uint64_t term_screen_hash(const struct TermScreen *screen,
+                                 uint64_t hash) {
+  int cells = screen->rows * screen->columns;
+  for (int i = 0; i < cells; i++) {
+    hash = (hash ^ (unsigned char)screen->cells[i]) * 0x100000001b3ULL;
+  }
+  hash = (hash ^ (uint64_t)screen->row) * 0x100000001b3ULL;
+  hash = (hash ^ (uint64_t)screen->column) * 0x100000001b3ULL;
+  return hash;
+}
+
+static void term_on_resize(int number) {
+  UNUSED(number);
+  int saved_errno = errno;
+  if (global_terminal) {
+    // If the pipe is full there is a resize pending already.
+    ssize_t written = write(global_terminal->resize_pipe[1], "", 1);
+    UNUSED(written);
+  }
+  errno = saved_errno;
+}
+
+static int term_get_size(int fileno, int *rows, int *cols) {
+  struct winsize ws;
+  if (ioctl(fileno, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+    // TODO: Complex escape codes to get the actual size. :P
+    return -1;
+  } else {
+    *cols = ws.ws_col;
+    *rows = ws.ws_row;
+    return 0;
+  }
+}
+
+// Set up what every kind of terminal has: the grids, the input ring, and
+// the rest of the state for drawing.
+static void term_init_common(struct Terminal *terminal, int rows,
+                             int columns) {
+  buffer_init(&terminal->buffer);
+  terminal->input_ring_read = 0;
+  terminal->input_ring_write = 0;
+  buffer_init(&terminal->paste);
+  terminal->rows = rows;
+  terminal->columns = columns;
+
+  int cells = terminal->rows * terminal->columns;
+  terminal->front = malloc(cells);
+  terminal->back = malloc(cells);
+  if (!terminal->front || !terminal->back) {
+    die("Cannot allocate screen");
+  }
+  // The first frame clears the screen, after which it is all blanks.
+  memset(terminal->front, ' ', cells);
+  memset(terminal->back, ' ', cells);
+  terminal->clear_pending = 1;
+  terminal->draw_row = 0;
+  terminal->draw_column = 0;
+  terminal->cursor_row = 0;
+  terminal->cursor_column = 0;
+  terminal->screen_row = -1;
+  terminal->screen_column = -1;
+  terminal->repeat = 0;
+  terminal->repeat_settled = 0;
+  terminal->synchronized = 0;
+  terminal->frame_bytes = 0;
+  terminal->total_bytes = 0;
+  terminal->frames = 0;
+  terminal->frame_us = 0;
+  terminal->total_us = 0;
+  terminal->read_us = 0;
+  terminal->resize_pending = 0;
+
+  // Ask for pastes to be bracketed, so they can go in as one insert.
+  buffer_append(&terminal->buffer, "\x1b[?2004h", 8);
+
+  // Ask whether frames can be synchronized; term_read picks up the answer.
+  buffer_append(&terminal->buffer, "\x1b[?2026$p", 9);
+
+  // And what the terminal is, which decides whether to use REP.
+  buffer_append(&terminal->buffer, "\x1b[c", 3);
+}
+
+// A terminal with nothing behind it: frames go to a screen in memory, and
+// the keys are the input given here.
+static void term_init_headless(struct Terminal *terminal, int rows,
+                               int columns, const char *input, int length) {
+  terminal->kind = TERM_HEADLESS;
+  terminal->screen = malloc(sizeof(struct TermScreen));
+  if (!terminal->screen) {
+    die("Cannot allocate screen");
+  }
+  term_screen_init(terminal->screen, rows, columns, input, length);
+  terminal->input_fileno = -1;
+  terminal->output_fileno = -1;
+  terminal->resize_pipe[0] = -1;
+  terminal->resize_pipe[1] = -1;
+  term_init_common(terminal, rows, columns);
+}
+
+static void term_init(struct Terminal *terminal, int input_fileno,
+                      int output_fileno) {
+  global_terminal = terminal;
+  terminal->kind = TERM_TTY;
+  terminal->screen = NULL;
+  terminal->input_fileno = input_fileno;
+  terminal->output_fileno = output_fileno;
+
+  // Setup raw mode for the terminal.
+  if (tcgetattr(input_fileno, &terminal->original_mode) == -1) {
+    die("tcgetattr setting raw");
+  }
+  struct termios raw = terminal->original_mode;
+  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+  raw.c_oflag &= ~(OPOST);
+  raw.c_cflag |= (CS8);
+  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+
+  // Reads never block; term_poll does the waiting.
+  raw.c_cc[VMIN] = 0;  // Minimum characters before returning.
+  raw.c_cc[VTIME] = 0; // Timeout in 100ms increments.
+
+  if (tcsetattr(input_fileno, TCSAFLUSH, &raw) == -1) {
+    die("tcsetattr setting raw");
+  }
+
+  int rows;
+  int columns;
+  if (term_get_size(input_fileno, &rows, &columns)) {
+    die("term_get_size");
+  }
+  term_init_common(terminal, rows, columns);
+
+  if (pipe(terminal->resize_pipe) == -1) {
+    die("pipe");
+  }
+  for (int i = 0; i < 2; i++) {
+    int fileno = terminal->resize_pipe[i];
+    int flags = fcntl(fileno, F_GETFL);
+    if (flags == -1 || fcntl(fileno, F_SETFL, flags | O_NONBLOCK) == -1 ||
+        fcntl(fileno, F_SETFD, FD_CLOEXEC) == -1) {
+      die("fcntl");
+    }
+  }
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = term_on_resize;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  if (sigaction(SIGWINCH, &action, NULL) == -1) {
+    die("sigaction");
+  }
+
+  atexit(term_atexit);
+}
+
+// Write all of the data, however many calls it takes. A slow terminal can
+// take a big frame in pieces, and a signal can interrupt a write.
+static void term_send(int fileno, const char *data, int length) {
+  while (length > 0) {
+    ssize_t written = write(fileno, data, length);
+    if (written > 0) {
+      data += written;
+      length -= (int)written;
+    } else if (written == -1 && errno == EAGAIN) {
+      struct pollfd output = {fileno, POLLOUT, 0};
+      poll(&output, 1, -1);
+    } else if (written == -1 && errno != EINTR) {
+      die("write");
+    }
+  }
+}
+
+// Put as many of the bytes as fit into the input ring, as if they had been
+// read. Returns how many went in.
+static int term_push_input(struct Terminal *terminal, const char *data,
+                           int length) {
+  unsigned used = terminal->input_ring_write - terminal->input_ring_read;
+  unsigned free_space = TERM_INPUT_RING_SIZE - used;
+  if ((unsigned)length > free_space) {
+    length = (int)free_space;
+  }
+  for (int i = 0; i < length; i++) {
+    unsigned index = terminal->input_ring_write & (TERM_INPUT_RING_SIZE - 1);
+    terminal->input_ring[index] = data[i];
+    terminal->input_ring_write += 1;
+  }
+  if (length > 0) {
+    terminal->read_us = clock_us();
+  }
+  return length;
+}
+
+// Send the bytes wherever this terminal's frames go.
+static void term_output(struct Terminal *terminal, const char *data,
+                        int length) {
+  switch (terminal->kind) {
+  case TERM_TTY:
+    term_send(terminal->output_fileno, data, length);
+    break;
+  case TERM_HEADLESS:
+    term_screen_feed(terminal->screen, data, length);
+    struct Buffer *replies = &terminal->screen->replies;
+    term_push_input(terminal, replies->memory, replies->length);
+    buffer_clear(replies);
+    break;
+  }
+}
+
+static void term_free(struct Terminal *terminal) {
+  switch (terminal->kind) {
+  case TERM_TTY: {
+    term_send(terminal->output_fileno, "\x1b[?2004l", 8);
+
+    struct termios *original = &(terminal->original_mode);
+    if (tcsetattr(terminal->input_fileno, TCSAFLUSH, original) == -1) {
+      die("tcsetattr");
+    }
+    signal(SIGWINCH, SIG_DFL);
+    close(terminal->resize_pipe[0]);
+    close(terminal->resize_pipe[1]);
+    global_terminal = NULL;
+    break;
+  }
+  case TERM_HEADLESS:
+    term_screen_free(terminal->screen);
+    free(terminal->screen);
+    terminal->screen = NULL;
+    break;
+  }
+
+  buffer_free(&terminal->buffer);
+  buffer_free(&terminal->paste);
+  free(terminal->front);
+  free(terminal->back);
+  terminal->front = NULL;
+  terminal->back = NULL;
+}
+
+static void term_atexit(void) {
+  if (global_terminal) {
+    term_free(global_terminal);
+  }
+}
+
+// Read whatever input is available into the ring, with one system call.
+// Poll has said there is input; zero bytes means the other end hung up.
+static void term_fill(struct Terminal *terminal) {
+  unsigned used = terminal->input_ring_write - terminal->input_ring_read;
+  unsigned free_space = TERM_INPUT_RING_SIZE - used;
+  if (free_space == 0) {
+    return;
+  }
+
+  // The free space may wrap around the end of the ring.
+  unsigned start = terminal->input_ring_write & (TERM_INPUT_RING_SIZE - 1);
+  unsigned first = TERM_INPUT_RING_SIZE - start;
+  if (first > free_space) {
+    first = free_space;
+  }
+  struct iovec spans[2];
+  spans[0].iov_base = terminal->input_ring + start;
+  spans[0].iov_len = first;
+  spans[1].iov_base = terminal->input_ring;
+  spans[1].iov_len = free_space - first;
+
+  int count = spans[1].iov_len ? 2 : 1;
+  ssize_t nread = readv(terminal->input_fileno, spans, count);
+  if (nread == -1 && errno != EAGAIN && errno != EINTR) {
+    die("read");
+  }
+  if (nread == 0) {
+    die("input closed");
+  }
+  if (nread > 0) {
+    terminal->input_ring_write += (unsigned)nread;
+    terminal->read_us = clock_us();
+  }
+}
+
+// Wait up to timeout_ms (-1 for ever) for input; returns non-zero if there
+// is some. Waiting is done in poll, so an idle editor uses no CPU; a resize,
+// a signal or the timeout ends the wait early. A resize sets resize_pending
+// for term_resize to pick up.
+static int term_poll(struct Terminal *terminal, int timeout_ms) {
+  if (terminal->input_ring_write != terminal->input_ring_read) {
+    return 1;
+  }
+
+  // A headless terminal's keys are all there from the start, so there is
+  // never anything to wait for. Running out is like the input closing.
+  if (terminal->kind == TERM_HEADLESS) {
+    struct TermScreen *screen = terminal->screen;
+    screen->input_read += term_push_input(
+        terminal, screen->input.memory + screen->input_read,
+        screen->input.length - screen->input_read);
+    if (terminal->input_ring_write == terminal->input_ring_read &&
+        timeout_ms < 0) {
+      die("input closed");
+    }
+    return terminal->input_ring_write != terminal->input_ring_read;
+  }
+
+  struct pollfd fds[2];
+  fds[0].fd = terminal->input_fileno;
+  fds[0].events = POLLIN;
+  fds[0].revents = 0;
+  fds[1].fd = terminal->resize_pipe[0];
+  fds[1].events = POLLIN;
+  fds[1].revents = 0;
+  int rc = poll(fds, 2, timeout_ms);
+  if (rc == -1 && errno != EINTR) {
+    die("poll");
+  }
+  if (rc > 0) {
+    if (fds[1].revents & POLLIN) {
+      char drain[64];
+      while (read(terminal->resize_pipe[0], drain, sizeof(drain)) > 0) {
+      }
+      terminal->resize_pending = 1;
+    }
+    if (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL) &&
+        !(fds[0].revents & POLLIN)) {
+      die("input closed");
+    }
+    if (fds[0].revents & POLLIN) {
+      term_fill(terminal);
+    }
+  }
+  return terminal->input_ring_write != terminal->input_ring_read;
+}
+
+// Take up the terminal's new size, if it has been resized since the last
+// call; returns non-zero if the size changed. The next frame repaints the
+// whole screen: terminals differ in what they do with the old contents (some
+// reflow it, some crop it), so nothing in front can be trusted.
+static int term_resize(struct Terminal *terminal) {
+  if (!terminal->resize_pending) {
+    return 0;
+  }
+  terminal->resize_pending = 0;
+
+  int rows;
+  int columns;
+  if (term_get_size(terminal->input_fileno, &rows, &columns) || rows < 2 ||
+      (rows == terminal->rows && columns == terminal->columns)) {
+    return 0;
+  }
+
+  int cells = rows * columns;
+  char *front = realloc(terminal->front, cells);
+  if (front) {
+    terminal->front = front;
+  }
+  char *back = realloc(terminal->back, cells);
+  if (back) {
+    terminal->back = back;
+  }
+  if (!front || !back) {
+    die("Cannot allocate screen");
+  }
+  memset(terminal->front, ' ', cells);
+  memset(terminal->back, ' ', cells);
+  terminal->rows = rows;
+  terminal->columns = columns;
+  terminal->clear_pending = 1;
+  terminal->screen_row = -1;
+  terminal->screen_column = -1;
+  return 1;
+}
+
+static char term_read_raw(struct Terminal *terminal) {
+  while (!term_poll(terminal, -1)) {
+  }
+  unsigned index = terminal->input_ring_read & (TERM_INPUT_RING_SIZE - 1);
+  terminal->input_ring_read += 1;
+  return terminal->input_ring[index];
+}
+
+#define KEY_CONTROL(c) (c - 'a' + 1)
+
+enum TermKey {
+  KEY_NONE = 0,
+  KEY_CONTROL_A = KEY_CONTROL('a'),
+  KEY_CONTROL_C = KEY_CONTROL('c'),
+  KEY_CONTROL_E = KEY_CONTROL('e'),
+  KEY_CONTROL_G = KEY_CONTROL('g'),
+  KEY_CONTROL_H = KEY_CONTROL('h'),
+  KEY_CONTROL_K = KEY_CONTROL('k'),
+  KEY_CONTROL_M = KEY_CONTROL('m'),
+  KEY_CONTROL_R = KEY_CONTROL('r'),
+  KEY_CONTROL_S = KEY_CONTROL('s'),
+  KEY_CONTROL_W = KEY_CONTROL('w'),
+  KEY_CONTROL_X = KEY_CONTROL('x'),
+  KEY_CONTROL_Y = KEY_CONTROL('y'),
+  KEY_CONTROL_UNDERSCORE = 31, // Also what C-/ sends.
+  KEY_ESCAPE = 27,
+  KEY_DEL = 127,
+  KEY_LEFT = 256,
+  KEY_RIGHT = 257,
+  KEY_UP = 258,
+  KEY_DOWN = 259,
+  KEY_HOME = 260,
+  KEY_END = 261,
+  KEY_PAGE_UP = 262,
+  KEY_PAGE_DOWN = 263,
+  KEY_DELETE = 264,
+
+  // A bracketed paste; the text is in the terminal's paste buffer.
+  KEY_PASTE = 265,
+
+  // C-space and C-@ send NUL, which would otherwise look like no key.
+  KEY_CONTROL_SPACE = 266,
+
+  // Modifiers are or'd into the key.
+  KEY_MOD_SHIFT = 0x200,
+  KEY_MOD_ALT = 0x400,
+  KEY_MOD_CONTROL = 0x800,
+};
+
+// How long to wait after an ESC for the rest of a sequence before deciding
+// that the user just pressed Escape.
+#define TERM_ESCAPE_TIMEOUT_MS (25)
+
+// The escape sequences we know, keyed on the final byte and the first
+// parameter. SS3 sequences (ESC O x) have no parameters and share the
+// entries with a parameter of zero.
+struct TermSequence {
+  char final;
+  int param;
+  enum TermKey key;
+};
+
+static const struct TermSequence term_sequences[] = {
+    {'A', 0, KEY_UP},        {'B', 0, KEY_DOWN},
+    {'C', 0, KEY_RIGHT},     {'D', 0, KEY_LEFT},
+    {'H', 0, KEY_HOME},      {'F', 0, KEY_END}, // "PC function key"
+    {'~', 1, KEY_HOME},      {'~', 7, KEY_HOME}, // VT 220, rxvt
+    {'~', 4, KEY_END},       {'~', 8, KEY_END},
+    {'~', 3, KEY_DELETE},    {'~', 5, KEY_PAGE_UP},
+    {'~', 6, KEY_PAGE_DOWN},
+};
+
+#define TERM_PASTE_START (200)
+#define TERM_PASTE_END "\x1b[201~"
+
+static enum TermKey term_lookup_sequence(char final, int *params,
+                                         int count) {
+  int first = count > 0 ? params[0] : 0;
+  if (final != '~' && first == 1) {
+    // "ESC [ 1 ; 5 A" is Control-Up.
+    first = 0;
+  }
+
+  int count_sequences = sizeof(term_sequences) / sizeof(term_sequences[0]);
+  for (int i = 0; i < count_sequences; i++) {
+    const struct TermSequence *sequence = &term_sequences[i];
+    if (sequence->final == final && sequence->param == first) {
+      int key = sequence->key;
+      if (count > 1 && params[1] > 1) {
+        int modifiers = params[1] - 1;
+        if (modifiers & 1) {
+          key |= KEY_MOD_SHIFT;
+        }
+        if (modifiers & 2) {
+          key |= KEY_MOD_ALT;
+        }
+        if (modifiers & 4) {
+          key |= KEY_MOD_CONTROL;
+        }
+      }
+      return key;
+    }
+  }
+  return KEY_NONE;
+}
+
+// Read a bracketed paste into the paste buffer. The text goes in as-is,
+// except that the carriage returns terminals send for newlines become
+// newlines.
+static void term_read_paste(struct Terminal *terminal) {
+  struct Buffer *paste = &terminal->paste;
+  const char *end = TERM_PASTE_END;
+  int end_length = strlen(end);
+  buffer_clear(paste);
+
+  for (;;) {
+    while (!term_poll(terminal, -1)) {
+    }
+
+    // Copy everything up to the next ESC in one go.
+    unsigned mask = TERM_INPUT_RING_SIZE - 1;
+    unsigned start = terminal->input_ring_read & mask;
+    unsigned available = terminal->input_ring_write - terminal->input_ring_read;
+    if (available > TERM_INPUT_RING_SIZE - start) {
+      available = TERM_INPUT_RING_SIZE - start;
+    }
+    const char *span = terminal->input_ring + start;
+    int64_t escape = text_find_byte(span, available, '\x1b');
+    unsigned plain = escape < 0 ? available : (unsigned)escape;
+    buffer_append(paste, span, plain);
+    terminal->input_ring_read += plain;
+    if (escape < 0) {
+      continue;
+    }
+
+    // Is it the end of the paste? An ESC that breaks the match could be
+    // where the end starts, so it starts the match over.
+    int matched = 0;
+    while (matched < end_length) {
+      char c = term_read_raw(terminal);
+      if (c == end[matched]) {
+        matched += 1;
+        continue;
+      }
+      buffer_append(paste, end, matched);
+      if (c == end[0]) {
+        matched = 1;
+        continue;
+      }
+      buffer_append(paste, &c, 1);
+      break;
+    }
+    if (matched == end_length) {
+      break;
+    }
+  }
+
+  // Lines end in CR, or CR LF, from most terminals; either is a newline.
+  int length = 0;
+  for (int i = 0; i < paste->length; i++) {
+    char c = paste->memory[i];
+    if (c == '\r') {
+      if (i + 1 < paste->length && paste->memory[i + 1] == '\n') {
+        continue;
+      }
+      c = '\n';
+    }
+    paste->memory[length++] = c;
+  }
+  paste->length = length;
+}
+
+// Decode one key from the input. Escape sequences are parsed in full into a
+// final byte and parameters and then looked up in term_sequences, so an
+// unknown sequence is consumed and ignored rather than leaking into the
+// document.
+static int term_read(struct Terminal *terminal) {
+  unsigned char c = (unsigned char)term_read_raw(terminal);
+  if (c == 0) {
+    return KEY_CONTROL_SPACE;
+  }
+  if (c != '\x1b') {
+    return c;
+  }
+  if (!term_poll(terminal, TERM_ESCAPE_TIMEOUT_MS)) {
+    return KEY_ESCAPE;
+  }
+
+  c = (unsigned char)term_read_raw(terminal);
+  if (c == 'O') {
+    // SS3: one more byte.
+    char final = term_read_raw(terminal);
+    return term_lookup_sequence(final, NULL, 0);
+  }
+  if (c != '[') {
+    return KEY_MOD_ALT | c;
+  }
+
+  // CSI: parameters, then intermediate bytes, then a final byte.
+  int params[TERM_MAX_PARAMS];
+  int count = 0;
+  int value = 0;
+  int has_value = 0;
+  int unusual = 0;
+  int report = 0;
+  for (;;) {
+    c = (unsigned char)term_read_raw(terminal);
+    if (c >= '0' && c <= '9') {
+      if (value < 100000) {
+        value = value * 10 + (c - '0');
+      }
+      has_value = 1;
+    } else if (c == ';') {
+      if (count < TERM_MAX_PARAMS) {
+        params[count++] = value;
+      }
+      value = 0;
+      has_value = 0;
+    } else if ((c == '?' && report == 0 && count == 0 && !has_value) ||
+               (c == '$' && report == 1)) {
+      // Maybe the answer to a mode query: "CSI ? mode ; state $ y".
+      report += 1;
+    } else if (c >= 0x20 && c <= 0x3f) {
+      // Private markers and intermediates: nothing we understand.
+      unusual = 1;
+    } else {
+      break;
+    }
+  }
+  if (has_value && count < TERM_MAX_PARAMS) {
+    params[count++] = value;
+  }
+  if (c == 'y' && report == 2 && !unusual && count == 2 &&
+      params[0] == TERM_SYNCHRONIZED_MODE) {
+    // 1 and 2 mean set and reset; 0 and 4 mean not supported.
+    terminal->synchronized = params[1] == 1 || params[1] == 2;
+    return KEY_NONE;
+  }
+  if (c == 'c' && report == 1 && !unusual && count > 0) {
+    // Device attributes: "CSI ? class ; features c". Class 62 and up is a
+    // VT220 or later, where REP is part of the set.
+    if (!terminal->repeat_settled) {
+      terminal->repeat = params[0] >= 62;
+    }
+    return KEY_NONE;
+  }
+  if (c < 0x40 || c > 0x7e || unusual || report) {
+    return KEY_NONE;
+  }
+
+  if (c == '~' && count > 0 && params[0] == TERM_PASTE_START) {
+    term_read_paste(terminal);
+    return KEY_PASTE;
+  }
+  return term_lookup_sequence((char)c, params, count);
+}
+
+// Clear the back grid, ready to draw a new frame.
+static void term_clear(struct Terminal *terminal) {
+  memset(terminal->back, ' ', terminal->rows * terminal->columns);
+  terminal->draw_row = 0;
+  terminal->draw_column = 0;
+}
+
+// Move where term_write draws.
+static void term_move(struct Terminal *terminal, int row, int col) {
+  terminal->draw_row = row;
+  terminal->draw_column = col;
+}
+
+// Draw text into the back grid. Carriage returns and newlines move the
+// drawing position the way they would on the terminal; anything that falls
+// off the edge of the screen is dropped.
+static void term_write(struct Terminal *terminal, const char *data,
+                       int length) {
+  for (int i = 0; i < length; i++) {
+    char c = data[i];
+    if (c == '\r') {
+      terminal->draw_column = 0;
+    } else if (c == '\n') {
+      terminal->draw_row += 1;
+    } else {
+      if (terminal->draw_row < terminal->rows &&
+          terminal->draw_column < terminal->columns) {
+        int cell =
+            terminal->draw_row * terminal->columns + terminal->draw_column;
+        terminal->back[cell] = c;
+      }
+      terminal->draw_column += 1;
+    }
+  }
+}
+
+// Say where the cursor should be when the frame is drawn.
+static void term_set_cursor(struct Terminal *terminal, int row, int col) {
+  terminal->cursor_row = row;
+  terminal->cursor_column = col;
+}
+
+static void term_append_csi(struct Buffer *buffer, int value, char command) {
+  buffer_append(buffer, "\x1b[", 2);
+  buffer_append_int(buffer, value);
+  buffer_append(buffer, &command, 1);
+}
+
+static int term_int_length(int value) {
+  int length = 1;
+  while (value >= 10) {
+    value /= 10;
+    length += 1;
+  }
+  return length;
+}
+
+// Moves are built from a few pieces, each of which can either be costed
+// (when out is NULL) or appended. Moving across a row, either printing what
+// is already there, backspacing, or with CUF or CUB.
+static int term_move_across(struct Terminal *terminal, int row, int from,
+                            int to, struct Buffer *out) {
+  if (to > from) {
+    int distance = to - from;
+    int cuf_length = 3 + term_int_length(distance);
+    if (distance <= cuf_length) {
+      if (out) {
+        const char *cells = terminal->front + row * terminal->columns;
+        buffer_append(out, cells + from, distance);
+      }
+      return distance;
+    }
+    if (out) {
+      term_append_csi(out, distance, 'C');
+    }
+    return cuf_length;
+  }
+  if (to < from) {
+    int distance = from - to;
+    int cub_length = 3 + term_int_length(distance);
+    if (distance <= cub_length) {
+      for (int i = 0; out && i < distance; i++) {
+        buffer_append(out, "\b", 1);
+      }
+      return distance;
+    }
+    if (out) {
+      term_append_csi(out, distance, 'D');
+    }
+    return cub_length;
+  }
+  return 0;
+}
+
+// Moving down (or up, if count is negative) within the same column. In raw
+// mode a line feed moves straight down, and reverse index straight up;
+// neither scrolls, since the target row is on the screen.
+static int term_move_down(int count, struct Buffer *out) {
+  if (count > 0) {
+    int cud_length = 3 + term_int_length(count);
+    if (count <= cud_length) {
+      for (int i = 0; out && i < count; i++) {
+        buffer_append(out, "\n", 1);
+      }
+      return count;
+    }
+    if (out) {
+      term_append_csi(out, count, 'B');
+    }
+    return cud_length;
+  }
+  if (count < 0) {
+    int cuu_length = 3 + term_int_length(-count);
+    if (-count * 2 <= cuu_length) {
+      for (int i = 0; out && i < -count; i++) {
+        buffer_append(out, "\x1bM", 2);
+      }
+      return -count * 2;
+    }
+    if (out) {
+      term_append_csi(out, -count, 'A');
+    }
+    return cuu_length;
+  }
+  return 0;
+}
+
+// CUP, leaving out the parameters that are 1.
+static int term_move_to(int row, int col, struct Buffer *out) {
+  int length = 3;
+  if (out) {
+    buffer_append(out, "\x1b[", 2);
+  }
+  if (row > 0) {
+    length += term_int_length(row + 1);
+    if (out) {
+      buffer_append_int(out, row + 1);
+    }
+  }
+  if (col > 0) {
+    length += 1 + term_int_length(col + 1);
+    if (out) {
+      buffer_append(out, ";", 1);
+      buffer_append_int(out, col + 1);
+    }
+  }
+  if (out) {
+    buffer_append(out, "H", 1);
+  }
+  return length;
+}
+
+// Append the cheapest sequence that moves the terminal's cursor from where it
+// is to the given cell: an absolute move, a relative one, or a carriage
+// return followed by a relative one.
+static void term_move_cursor(struct Terminal *terminal, int row, int col) {
+  struct Buffer *buffer = &terminal->buffer;
+  int screen_row = terminal->screen_row;
+  int screen_column = terminal->screen_column;
+  if (screen_row == row && screen_column == col) {
+    return;
+  }
+
+  terminal->screen_row = row;
+  terminal->screen_column = col;
+
+  int best = term_move_to(row, col, NULL);
+  if (screen_row < 0 || screen_column < 0) {
+    term_move_to(row, col, buffer);
+    return;
+  }
+
+  int down = term_move_down(row - screen_row, NULL);
+  int across = down + term_move_across(terminal, row, screen_column, col, NULL);
+  int home = down + 1 + term_move_across(terminal, row, 0, col, NULL);
+  if (best <= across && best <= home) {
+    term_move_to(row, col, buffer);
+  } else if (across <= home) {
+    term_move_down(row - screen_row, buffer);
+    term_move_across(terminal, row, screen_column, col, buffer);
+  } else {
+    term_move_down(row - screen_row, buffer);
+    buffer_append(buffer, "\r", 1);
+    term_move_across(terminal, row, 0, col, buffer);
+  }
+}
+
+// Scroll the lines from top to bottom (inclusive) by count lines: up if
+// count is positive, down if it is negative. The terminal moves its own
+// contents, so the next term_draw only has to paint the lines that scrolled
+// into view.
+static void term_scroll(struct Terminal *terminal, int top, int bottom,
+                        int count) {
+  int height = bottom - top + 1;
+  if (terminal->clear_pending || count == 0 || count >= height ||
+      -count >= height) {
+    // Either the whole screen is going to be painted anyway, or nothing
+    // that is on the screen now would survive the scroll.
+    return;
+  }
+
+  struct Buffer *buffer = &terminal->buffer;
+  buffer_append(buffer, "\x1b[", 2); // Set scroll region
+  buffer_append_int(buffer, top + 1);
+  buffer_append(buffer, ";", 1);
+  buffer_append_int(buffer, bottom + 1);
+  buffer_append(buffer, "r", 1);
+  if (count > 0) {
+    term_append_csi(buffer, count, 'S'); // Scroll up
+  } else {
+    term_append_csi(buffer, -count, 'T'); // Scroll down
+  }
+  buffer_append(buffer, "\x1b[r", 3); // Reset scroll region
+
+  // Resetting the scroll region homes the cursor.
+  terminal->screen_row = 0;
+  terminal->screen_column = 0;
+
+  // Move the front grid the same way the terminal moved.
+  int columns = terminal->columns;
+  char *region = terminal->front + top * columns;
+  if (count > 0) {
+    memmove(region, region + count * columns, (height - count) * columns);
+    memset(region + (height - count) * columns, ' ', count * columns);
+  } else {
+    memmove(region - count * columns, region, (height + count) * columns);
+    memset(region, ' ', -count * columns);
+  }
+}
+
+// Send the difference between the back grid and what's on the screen.
+static void term_draw(struct Terminal *terminal) {
+  int64_t start_us = clock_us();
+  struct Buffer *buffer = &terminal->buffer;
+  int rows = terminal->rows;
+  int columns = terminal->columns;
+
+  if (terminal->clear_pending) {
+    buffer_append(buffer, "\x1b[2J", 4); // Clear screen
+    terminal->clear_pending = 0;
+    terminal->screen_row = -1;
+    terminal->screen_column = -1;
+  }
+
+  // Hide the cursor while it jumps around, but only if there is a lot to
+  // draw; a single changed cell shouldn't cost two extra sequences. If the
+  // terminal can take the frame all at once, nothing in between shows
+  // anyway, including the scrolling that has already been queued up.
+  int dirty_rows = 0;
+  for (int row = 0; row < rows; row++) {
+    if (memcmp(terminal->front + row * columns, terminal->back + row * columns,
+               columns)) {
+      dirty_rows += 1;
+    }
+  }
+  int synchronized =
+      terminal->synchronized && (dirty_rows > 1 || buffer->length > 0);
+  if (synchronized) {
+    buffer_insert(buffer, 0, "\x1b[?2026h", 8); // Begin synchronized update
+  } else if (dirty_rows > 1) {
+    buffer_append(buffer, "\x1b[?25l", 6); // Hide cursor
+  }
+
+  for (int row = 0; row < rows && dirty_rows > 0; row++) {
+    char *front = terminal->front + row * columns;
+    char *back = terminal->back + row * columns;
+    if (!memcmp(front, back, columns)) {
+      continue;
+    }
+
+    // Past `blank` the new row is all spaces; past `last` nothing changes.
+    int blank = columns;
+    while (blank > 0 && back[blank - 1] == ' ') {
+      blank -= 1;
+    }
+    int last = columns - 1;
+    while (front[last] == back[last]) {
+      last -= 1;
+    }
+
+    int col = 0;
+    while (col <= last) {
+      if (front[col] == back[col]) {
+        col += 1;
+        continue;
+      }
+      term_move_cursor(terminal, row, col);
+
+      // Nothing but blanks from here on: erase to the end of the line.
+      if (col >= blank) {
+        buffer_append(buffer, "\x1b[K", 3);
+        memset(front + col, ' ', columns - col);
+        break;
+      }
+
+      int run = 1;
+      while (col + run < columns && back[col + run] == back[col]) {
+        run += 1;
+      }
+
+      // Blanks that are the last change on the row can be erased without
+      // moving the cursor.
+      if (back[col] == ' ' && col + run > last &&
+          3 + term_int_length(run) < run) {
+        term_append_csi(buffer, run, 'X');
+        memset(front + col, ' ', run);
+        break;
+      }
+
+      // Print the character, and repeat it if that is shorter than printing
+      // the rest of the run. Otherwise just this cell is drawn.
+      buffer_append(buffer, back + col, 1);
+      if (terminal->repeat && run - 1 > 3 + term_int_length(run - 1)) {
+        term_append_csi(buffer, run - 1, 'b');
+      } else {
+        run = 1;
+      }
+      memcpy(front + col, back + col, run);
+      col += run;
+
+      // Writing the last column leaves the cursor in a state that differs
+      // between terminals, so forget where it is.
+      terminal->screen_column = col;
+      if (col >= columns) {
+        terminal->screen_row = -1;
+        terminal->screen_column = -1;
+      }
+    }
+  }
+
+  // Put the cursor where it belongs.
+  int cursor_row = terminal->cursor_row;
+  int cursor_column = terminal->cursor_column;
+  if (cursor_row >= rows) {
+    cursor_row = rows - 1;
+  }
+  if (cursor_column >= columns) {
+    cursor_column = columns - 1;
+  }
+  term_move_cursor(terminal, cursor_row, cursor_column);
+
+  if (synchronized) {
+    buffer_append(buffer, "\x1b[?2026l", 8); // End synchronized update
+  } else if (dirty_rows > 1) {
+    buffer_append(buffer, "\x1b[?25h", 6); // Show cursor
+  }
+  terminal->frame_bytes = buffer->length;
+  terminal->total_bytes += buffer->length;
+  terminal->frames += 1;
+  term_output(terminal, buffer->memory, buffer->length);
+  buffer_clear(buffer);
+  terminal->frame_us = clock_us() - start_us;
+  terminal->total_us += terminal->frame_us;
+}
+
+struct Editor;
+struct KeyMap;
+typedef void (*KEY_FN)(struct Editor *, int);
+
+struct KeyBinding {
+  enum TermKey key;
+  KEY_FN fn;
+  const struct KeyMap *map;
+};
+
+// Keys below this are looked up directly; that covers every unmodified key.
+// Keys with modifiers go in a small hash table.
+#define KEYMAP_DIRECT_KEYS (512)
+
+// The editor's own keymaps are constant tables built by the compiler (see
+// editor_default_keymap), so nothing here is reference counted: a map
+// doesn't own its parent or the maps it binds keys to, they just have to
+// outlive it. Maps made at runtime are overlays on top of those tables.
+struct KeyMap {
+  struct KeyBinding direct[KEYMAP_DIRECT_KEYS];
+
+  // Open addressing with linear probing; KEY_NONE marks an empty slot, and
+  // can't collide with a real key because it is below KEYMAP_DIRECT_KEYS.
+  // Constant maps leave this empty.
+  struct KeyBinding *hashed;
+  int hashed_capacity;
+  int hashed_count;
+
+  // Keys that aren't bound here are looked up in the parent.
+  const struct KeyMap *parent;
+};
+
+static void keymap_init(struct KeyMap **map, const struct KeyMap *parent) {
+  const int keymap_initial_hashed = 16;
+  struct KeyMap *m = malloc(sizeof(struct KeyMap));
+  if (!m) {
+    die("Cannot allocate keymap");
+  }
+  memset(m->direct, 0, sizeof(m->direct));
+  m->hashed = calloc(keymap_initial_hashed, sizeof(struct KeyBinding));
+  if (!m->hashed) {
+    die("Cannot allocate keymap");
+  }
+  m->hashed_capacity = keymap_initial_hashed;
+  m->hashed_count = 0;
+  m->parent = parent;
+  *map = m;
+}
+
+static void keymap_free(struct KeyMap **map) {
+  if (map && *map) {
+    free((*map)->hashed);
+    free(*map);
+    *map = NULL;
+  }
+}
+
+static unsigned keymap_hash(int key, int capacity) {
+  return ((unsigned)key * 2654435761u) & (unsigned)(capacity - 1);
+}
+
+// Find where a hashed key lives in the map, or the empty slot where it
+// would go. The table must not be empty.
+static int keymap_hashed_index(const struct KeyMap *map, int key) {
+  unsigned mask = (unsigned)(map->hashed_capacity - 1);
+  unsigned index = keymap_hash(key, map->hashed_capacity);
+  while (map->hashed[index].key != KEY_NONE &&
+         (int)map->hashed[index].key != key) {
+    index = (index + 1) & mask;
+  }
+  return (int)index;
+}
+
+static struct KeyBinding *keymap_slot(struct KeyMap *map, int key) {
+  if (key >= 0 && key < KEYMAP_DIRECT_KEYS) {
+    return &map->direct[key];
+  }
+  return &map->hashed[keymap_hashed_index(map, key)];
+}
+
+static void keymap_grow_hashed(struct KeyMap *map) {
+  struct KeyBinding *old = map->hashed;
+  int old_capacity = map->hashed_capacity;
+
+  map->hashed_capacity *= 2;
+  map->hashed = calloc(map->hashed_capacity, sizeof(struct KeyBinding));
+  if (!map->hashed) {
+    die("Cannot grow keymap");
+  }
+  for (int i = 0; i < old_capacity; i++) {
+    if (old[i].key != KEY_NONE) {
+      *keymap_slot(map, old[i].key) = old[i];
+    }
+  }
+  free(old);
+}
+
+// Bind a key to a function; binding a key again replaces what was there.
+static void keymap_bind_key_fn(struct KeyMap *map, int key, KEY_FN fn) {
+  int hashed = key >= KEYMAP_DIRECT_KEYS || key < 0;
+  if (hashed && (map->hashed_count + 1) * 2 > map->hashed_capacity) {
+    keymap_grow_hashed(map);
+  }
+
+  struct KeyBinding *binding = keymap_slot(map, key);
+  if (hashed && !binding->fn && !binding->map) {
+    map->hashed_count += 1;
+  }
+  binding->key = key;
+  binding->fn = fn;
+  binding->map = NULL;
+}
+
+// Look a key up in the map, then in its parents.
+static const struct KeyBinding *keymap_lookup(const struct KeyMap *map,
+                                              int key) {
+  for (; map; map = map->parent) {
+    const struct KeyBinding *binding = NULL;
+    if (key >= 0 && key < KEYMAP_DIRECT_KEYS) {
+      binding = &map->direct[key];
+    } else if (map->hashed_capacity) {
+      binding = &map->hashed[keymap_hashed_index(map, key)];
+    }
+    if (binding && (binding->fn || binding->map)) {
+      return binding;
+    }
+  }
+  return NULL;
+}
+
+// How long it takes from reading a key to having sent the frame that shows
+// what it did, in microseconds. Latencies go in log-linear buckets: one per
+// microsecond below 32, then 16 for each power of two, so a bucket is never
+// more than a sixteenth of its value wide. Recording one is an increment.
+#define LATENCY_SUB_BITS (4)
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((32 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+struct LatencyHistogram {
+  int64_t count;
+  int64_t max;
+  uint32_t buckets[LATENCY_BUCKETS];
+};
+
+// A key that has been handled but not yet drawn.
+struct LatencyEvent {
+  int command;
+  int64_t read_us;
+};
+
+// A histogram for each command, made the first time it's needed.
+struct LatencyLog {
+  struct LatencyHistogram **histograms;
+  int count;
+
+  // The command of the last key drawn.
+  int last;
+
+  struct LatencyEvent *pending;
+  int pending_count;
+  int pending_capacity;
+};
+
+static void latency_init(struct LatencyLog *log, int count) {
+  log->histograms = calloc(count, sizeof(struct LatencyHistogram *));
+  if (!log->histograms) {
+    die("Cannot allocate latency log");
+  }
+  log->count = count;
+  log->last = -1;
+  log->pending = NULL;
+  log->pending_count = 0;
+  log->pending_capacity = 0;
+}
+
+static void latency_free(struct LatencyLog *log) {
+  for (int i = 0; i < log->count; i++) {
+    free(log->histograms[i]);
+  }
+  free(log->histograms);
+  free(log->pending);
+  log->histograms = NULL;
+  log->pending = NULL;
+}
+
+static int latency_bucket(int64_t us) {
+  if (us < 2 * LATENCY_SUB_BUCKETS) {
+    return us < 0 ? 0 : (int)us;
+  }
+  if (us > UINT32_MAX) {
+    us = UINT32_MAX;
+  }
+  int shift = 31 - __builtin_clz((uint32_t)us) - LATENCY_SUB_BITS;
+  return (shift << LATENCY_SUB_BITS) + (int)(us >> shift);
+}
+
+// The largest latency that goes in the bucket.
+static int64_t latency_bucket_top(int bucket) {
+  if (bucket < 2 * LATENCY_SUB_BUCKETS) {
+    return bucket;
+  }
+  int shift = (bucket >> LATENCY_SUB_BITS) - 1;
+  int64_t sub = (bucket & (LATENCY_SUB_BUCKETS - 1)) + LATENCY_SUB_BUCKETS;
+  return ((sub + 1) << shift) - 1;
+}
+
+// Remember that a key run by the command was read at read_us. It's counted
+// once the next frame has been sent.
+static void latency_add(struct LatencyLog *log, int command, int64_t read_us) {
+  if (log->pending_count == log->pending_capacity) {
+    log->pending_capacity =
+        log->pending_capacity ? log->pending_capacity * 2 : 64;
+    log->pending = realloc(log->pending, sizeof(struct LatencyEvent) *
+                                             log->pending_capacity);
+    if (!log->pending) {
+      die("Cannot grow latency log");
+    }
+  }
+  struct LatencyEvent *event = &log->pending[log->pending_count++];
+  event->command = command;
+  event->read_us = read_us;
+}
+
+// A frame finished going out at now_us: every key waiting for it is done.
+static void latency_frame(struct LatencyLog *log, int64_t now_us) {
+  for (int i = 0; i < log->pending_count; i++) {
+    struct LatencyEvent *event = &log->pending[i];
+    struct LatencyHistogram *histogram = log->histograms[event->command];
+    if (!histogram) {
+      histogram = calloc(1, sizeof(struct LatencyHistogram));
+      if (!histogram) {
+        die("Cannot allocate latency histogram");
+      }
+      log->histograms[event->command] = histogram;
+    }
+    int64_t us = now_us - event->read_us;
+    histogram->buckets[latency_bucket(us)] += 1;
+    histogram->count += 1;
+    if (us > histogram->max) {
+      histogram->max = us;
+    }
+    log->last = event->command;
+  }
+  log->pending_count = 0;
+}
+
+// The latency that permille thousandths of keys took no longer than, to
+// within a bucket.
+static int64_t latency_percentile(const struct LatencyHistogram *histogram,
+                                  int permille) {
+  int64_t rank = (histogram->count * permille + 999) / 1000;
+  int64_t seen = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= rank && seen > 0) {
+      int64_t top = latency_bucket_top(i);
+      return top < histogram->max ? top : histogram->max;
+    }
+  }
+  return histogram->max;
+}
+
+#define EDITOR_KILL_RING_SIZE (16)
+#define EDITOR_SEARCH_MAX (256)
+#define EDITOR_PROMPT_MAX (256)
+#define EDITOR_MESSAGE_MAX (80)
+
+// A row of the screen: a line of the document, and which of the line's
+// visual rows. Every byte takes one cell, so when lines wrap, row n of a
+// line starts n screen widths into it; otherwise each line is one row.
+struct EditorRow {
+  int64_t line;
+  int64_t row;
+};
+
+struct Editor {
+  // Bindings from the image on top of editor_default_keymap, or NULL when
+  // there aren't any. The current keymap is borrowed from one or the other.
+  struct KeyMap *keymap;
+  const struct KeyMap *current_keymap;
+  struct Document document;
+  struct UndoLog undo;
+  struct Buffer status_buffer;
+  int64_t position;
+
+  // The other end of the region, or -1 if it hasn't been set.
+  int64_t mark;
+
+  // Killed text, newest at kill_newest. Only the first kill_count entries
+  // have been initialized.
+  struct Buffer kill_ring[EDITOR_KILL_RING_SIZE];
+  int kill_count;
+  int kill_newest;
+
+  // While searching, prompting and so on, keys are looked up in the mode's
+  // keymap first. Keys it doesn't bind are ignored, unless there is an exit
+  // function; then that runs and the key is handled as usual.
+  const struct KeyMap *mode_keymap;
+  KEY_FN mode_exit;
+
+  // Shown in the status line until the next key.
+  char message[EDITOR_MESSAGE_MAX];
+
+  // A question in the status line, and what to do with the answer.
+  const char *prompt_label;
+  char prompt[EDITOR_PROMPT_MAX];
+  int prompt_length;
+  void (*prompt_done)(struct Editor *);
+
+  // The last regular expression searched for, and the current match when
+  // replacing.
+  struct Regex regex;
+  char regex_source[EDITOR_PROMPT_MAX];
+  int regex_length;
+  char replacement[EDITOR_PROMPT_MAX];
+  int replacement_length;
+  int64_t match_start;
+  int64_t match_end;
+  int replaced;
+
+  // Set when replacing everything was too big to go in the undo log.
+  int replace_lost_undo;
+
+  // Incremental search. For each prefix of the search string we remember
+  // where its match starts, or -1 if it failed, so that adding a character
+  // only has to look on from the last match, and deleting one goes back.
+  int search_forward;
+  int64_t search_origin;
+  char search[EDITOR_SEARCH_MAX];
+  int search_length;
+  int64_t search_matches[EDITOR_SEARCH_MAX + 1];
+
+  // The row shown at the top of the screen, and how much text fits on it.
+  struct EditorRow top;
+  int text_rows;
+  int text_columns;
+
+  // Whether long lines wrap onto more rows, rather than being cut off at
+  // the edge of the screen.
+  int wrap;
+
+  // Whether the status line shows how many bytes frames take to send.
+  int show_frame_bytes;
+
+  // How long keys take to show, by command, and whether the status line
+  // shows it for the last one.
+  struct LatencyLog latency;
+  int show_latency;
+
+  // The top row as of the last frame, so we know how far the view moved.
+  struct EditorRow drawn_top;
+
+  int last_key;
+
+  // The last command run, so that runs of typing can be undone together.
+  KEY_FN last_command;
+  int running;
+};
+
+static void editor_quit(struct Editor *e, int c) {
+  UNUSED(e);
+  UNUSED(c);
+  e->running = 0;
+}
+
+// The line of the cursor comes from the document's line index.
+static int64_t editor_row(struct Editor *e) {
+  return doc_line_of(&e->document, e->position);
+}
+
+// The offset of the newline at the end of the given line, or the end of the
+// document if this is the last line.
+static int64_t editor_line_end(struct Editor *e, int64_t line) {
+  int64_t next = doc_line_start(&e->document, line + 1);
+  if (next < 0) {
+    return doc_length(&e->document);
+  } else {
+    return next - 1;
+  }
+}
+
+// How many bytes of a line fit on a row.
+static int64_t editor_wrap_width(struct Editor *e) {
+  if (!e->wrap || e->text_columns < 1) {
+    return INT64_MAX;
+  }
+  return e->text_columns;
+}
+
+// The number of rows a line takes up. A line that exactly fills its last row
+// gets another, so that the cursor has somewhere to go at its end. None of
+// this reads the text: the line index knows how long every line is, and
+// keeps track of that as lines are edited.
+static int64_t editor_line_rows(struct Editor *e, int64_t line) {
+  int64_t length =
+      editor_line_end(e, line) - doc_line_start(&e->document, line);
+  return length / editor_wrap_width(e) + 1;
+}
+
+static struct EditorRow editor_row_of(struct Editor *e, int64_t position) {
+  struct EditorRow at;
+  at.line = doc_line_of(&e->document, position);
+  at.row = (position - doc_line_start(&e->document, at.line)) /
+           editor_wrap_width(e);
+  return at;
+}
+
+static int64_t editor_row_start(struct Editor *e, struct EditorRow at) {
+  return doc_line_start(&e->document, at.line) + at.row * editor_wrap_width(e);
+}
+
+static int editor_row_before(struct EditorRow a, struct EditorRow b) {
+  return a.line < b.line || (a.line == b.line && a.row < b.row);
+}
+
+// Move down by count rows, or up if count is negative, stopping at either
+// end of the document. Returns how many rows it moved.
+static int64_t editor_step_rows(struct Editor *e, struct EditorRow *at,
+                                int64_t count) {
+  int64_t moved = 0;
+  if (count > 0) {
+    int64_t last_line = doc_line_of(&e->document, doc_length(&e->document));
+    while (count > 0) {
+      int64_t left = editor_line_rows(e, at->line) - 1 - at->row;
+      if (count <= left || at->line == last_line) {
+        int64_t step = count < left ? count : left;
+        at->row += step;
+        moved += step;
+        break;
+      }
+      moved += left + 1;
+      count -= left + 1;
+      at->line += 1;
+      at->row = 0;
+    }
+  } else {
+    count = -count;
+    while (count > 0) {
+      if (count <= at->row || at->line == 0) {
+        int64_t step = count < at->row ? count : at->row;
+        at->row -= step;
+        moved += step;
+        break;
+      }
+      moved += at->row + 1;
+      count -= at->row + 1;
+      at->line -= 1;
+      at->row = editor_line_rows(e, at->line) - 1;
+    }
+  }
+  return moved;
+}
+
+// How many rows down `to` is from `from`, or limit if it is further than
+// that.
+static int64_t editor_rows_between(struct Editor *e, struct EditorRow from,
+                                   struct EditorRow to, int64_t limit) {
+  if (to.line - from.line >= limit) {
+    return limit;
+  }
+  int64_t rows = to.row - from.row;
+  for (int64_t line = from.line; line < to.line && rows < limit; line++) {
+    rows += editor_line_rows(e, line);
+  }
+  return rows < limit ? rows : limit;
+}
+
+// All edits go through these two, so that they can be undone.
+static void editor_insert(struct Editor *e, const char *data,
+                          int64_t length) {
+  undo_insert(&e->undo, e->position, data, length, e->position);
+  doc_insert(&e->document, e->position, data, length);
+  if (e->mark > e->position) {
+    e->mark += length;
+  }
+  e->position += length;
+}
+
+static void editor_erase(struct Editor *e, int64_t position, int64_t length) {
+  undo_erase(&e->undo, &e->document, position, length, e->position);
+  doc_erase(&e->document, position, length);
+  if (e->mark > position) {
+    e->mark = e->mark - length < position ? position : e->mark - length;
+  }
+}
+
+static void editor_insert_self(struct Editor *e, int c) {
+  char ch = (char)c;
+  editor_insert(e, &ch, 1);
+}
+
+// Insert a run of text, such as a paste, in one go. It is undone on its own.
+static void editor_insert_text(struct Editor *e, const char *data,
+                               int64_t length) {
+  undo_boundary(&e->undo);
+  editor_insert(e, data, length);
+  undo_boundary(&e->undo);
+  e->last_command = NULL;
+}
+
+static void editor_insert_line(struct Editor *e, int c) {
+  UNUSED(c);
+  char nl = '\n';
+  editor_insert(e, &nl, 1);
+}
+
+static void editor_backspace(struct Editor *e, int c) {
+  UNUSED(c);
+  if (e->position > 0) {
+    editor_erase(e, e->position - 1, 1);
+    e->position -= 1;
+  }
+}
+
+static void editor_kill_line(struct Editor *e, int c);
+static void editor_kill_region(struct Editor *e, int c);
+
+// Move a range of the document into the kill ring. Kills straight after
+// another kill add to the same entry, so that C-k C-k C-k yanks back as one.
+static void editor_kill(struct Editor *e, int64_t start, int64_t end) {
+  if (start >= end) {
+    return;
+  }
+
+  int append = e->kill_count && (e->last_command == editor_kill_line ||
+                                 e->last_command == editor_kill_region);
+  if (!append) {
+    if (e->kill_count < EDITOR_KILL_RING_SIZE) {
+      e->kill_newest = e->kill_count;
+      buffer_init(&e->kill_ring[e->kill_newest]);
+      e->kill_count += 1;
+    } else {
+      e->kill_newest = (e->kill_newest + 1) % EDITOR_KILL_RING_SIZE;
+      buffer_clear(&e->kill_ring[e->kill_newest]);
+    }
+  }
+
+  struct Buffer *kill = &e->kill_ring[e->kill_newest];
+  if (end - start > INT_MAX - kill->length) {
+    die("kill too large");
+  }
+  doc_copy(&e->document, start, end - start, kill);
+  editor_erase(e, start, end - start);
+  e->position = start;
+}
+
+// Kill to the end of the line, or the newline itself if we're already there.
+static void editor_kill_line(struct Editor *e, int c) {
+  UNUSED(c);
+  int64_t end = editor_line_end(e, editor_row(e));
+  if (end == e->position && end < doc_length(&e->document)) {
+    end += 1;
+  }
+  editor_kill(e, e->position, end);
+}
+
+static void editor_kill_region(struct Editor *e, int c) {
+  UNUSED(c);
+  if (e->mark < 0) {
+    return;
+  }
+  int64_t mark = e->mark;
+  if (mark > doc_length(&e->document)) {
+    mark = doc_length(&e->document);
+  }
+  if (mark < e->position) {
+    editor_kill(e, mark, e->position);
+  } else {
+    editor_kill(e, e->position, mark);
+  }
+}
+
+// Insert the newest kill, leaving the mark at the start of it.
+static void editor_yank(struct Editor *e, int c) {
+  UNUSED(c);
+  if (e->kill_count) {
+    struct Buffer *kill = &e->kill_ring[e->kill_newest];
+    e->mark = e->position;
+    editor_insert(e, kill->memory, kill->length);
+  }
+}
+
+static void editor_set_mark(struct Editor *e, int c) {
+  UNUSED(c);
+  e->mark = e->position;
+}
+
+// Put the cursor at the end of the current match (the start, searching
+// backwards). A failed search leaves it at the last match that worked.
+static void editor_isearch_show(struct Editor *e) {
+  int64_t match = e->search_matches[e->search_length];
+  if (match >= 0) {
+    e->position = e->search_forward ? match + e->search_length : match;
+  }
+}
+
+// Look for the search string from the position in the current direction.
+static void editor_isearch_find(struct Editor *e, int64_t from) {
+  int64_t match;
+  if (e->search_forward) {
+    match = doc_search(&e->document, e->search, e->search_length, from);
+  } else {
+    match = doc_rsearch(&e->document, e->search, e->search_length, from);
+  }
+  e->search_matches[e->search_length] = match;
+  editor_isearch_show(e);
+}
+
+static const struct KeyMap editor_isearch_keymap;
+
+static int editor_searching(struct Editor *e) {
+  return e->mode_keymap == &editor_isearch_keymap;
+}
+
+static void editor_isearch_exit(struct Editor *e, int c);
+
+static void editor_isearch_start(struct Editor *e, int forward) {
+  e->mode_keymap = &editor_isearch_keymap;
+  e->mode_exit = editor_isearch_exit;
+  e->search_forward = forward;
+  e->search_origin = e->position;
+  e->search_length = 0;
+  e->search_matches[0] = e->position;
+}
+
+// C-s and C-r start a search, or look for the next match. After a failure
+// they wrap around to the other end of the document.
+static void editor_isearch_forward(struct Editor *e, int c) {
+  UNUSED(c);
+  if (!editor_searching(e)) {
+    editor_isearch_start(e, 1);
+    return;
+  }
+  e->search_forward = 1;
+  if (e->search_length) {
+    int64_t match = e->search_matches[e->search_length];
+    editor_isearch_find(e, match >= 0 ? match + 1 : 0);
+  }
+}
+
+static void editor_isearch_backward(struct Editor *e, int c) {
+  UNUSED(c);
+  if (!editor_searching(e)) {
+    editor_isearch_start(e, 0);
+    return;
+  }
+  e->search_forward = 0;
+  if (e->search_length) {
+    int64_t match = e->search_matches[e->search_length];
+    editor_isearch_find(e, match >= 0 ? match - 1 : doc_length(&e->document));
+  }
+}
+
+// A longer string can only match where the shorter one did or further on,
+// so start from the last match, which usually still matches.
+static void editor_isearch_printing(struct Editor *e, int c) {
+  if (e->search_length == EDITOR_SEARCH_MAX) {
+    return;
+  }
+  int64_t match = e->search_matches[e->search_length];
+  e->search[e->search_length++] = (char)c;
+  if (match < 0) {
+    e->search_matches[e->search_length] = -1;
+  } else if (doc_matches(&e->document, match, e->search, e->search_length)) {
+    e->search_matches[e->search_length] = match;
+    editor_isearch_show(e);
+  } else {
+    editor_isearch_find(e, e->search_forward ? match + 1 : match - 1);
+  }
+}
+
+static void editor_isearch_delete(struct Editor *e, int c) {
+  UNUSED(c);
+  if (e->search_length) {
+    e->search_length -= 1;
+    if (e->search_length == 0) {
+      e->position = e->search_origin;
+    } else {
+      editor_isearch_show(e);
+    }
+  }
+}
+
+// Leaving the search keeps the cursor at the match and the mark where the
+// search started.
+static void editor_isearch_exit(struct Editor *e, int c) {
+  UNUSED(c);
+  e->mode_keymap = NULL;
+  e->mark = e->search_origin;
+}
+
+static void editor_isearch_abort(struct Editor *e, int c) {
+  UNUSED(c);
+  e->mode_keymap = NULL;
+  e->position = e->search_origin;
+}
+
+static const struct KeyMap editor_prompt_keymap;
+
+// Ask for a line of text in the status line; done gets called with it in
+// e->prompt.
+static void editor_prompt(struct Editor *e, const char *label,
+                          void (*done)(struct Editor *)) {
+  e->mode_keymap = &editor_prompt_keymap;
+  e->mode_exit = NULL;
+  e->prompt_label = label;
+  e->prompt_length = 0;
+  e->prompt_done = done;
+}
+
+static void editor_prompt_insert(struct Editor *e, int c) {
+  if (e->prompt_length < EDITOR_PROMPT_MAX) {
+    e->prompt[e->prompt_length++] = (char)c;
+  }
+}
+
+static void editor_prompt_delete(struct Editor *e, int c) {
+  UNUSED(c);
+  if (e->prompt_length) {
+    e->prompt_length -= 1;
+  }
+}
+
+static void editor_prompt_accept(struct Editor *e, int c) {
+  UNUSED(c);
+  e->mode_keymap = NULL;
+  e->prompt_done(e);
+}
+
+static void editor_prompt_abort(struct Editor *e, int c) {
+  UNUSED(c);
+  e->mode_keymap = NULL;
+  snprintf(e->message, sizeof(e->message), "Quit");
+}
+
+// Compile what was typed at the prompt as the new regular expression. An
+// empty answer keeps the last one. Returns 0 if there's nothing usable.
+static int editor_take_regex(struct Editor *e) {
+  if (e->prompt_length) {
+    struct Regex regex;
+    const char *error = regex_compile(&regex, e->prompt, e->prompt_length);
+    if (error) {
+      snprintf(e->message, sizeof(e->message), "%s", error);
+      return 0;
+    }
+    regex_free(&e->regex);
+    e->regex = regex;
+    memcpy(e->regex_source, e->prompt, e->prompt_length);
+    e->regex_length = e->prompt_length;
+  }
+  if (!e->regex_length) {
+    snprintf(e->message, sizeof(e->message), "No previous regexp");
+    return 0;
+  }
+  return 1;
+}
+
+// Find the next match at or after the position, skipping an empty match
+// right there so that repeating a search moves along.
+static int editor_regex_find(struct Editor *e, int64_t position) {
+  if (!regex_search(&e->regex, &e->document, position, &e->match_start,
+                    &e->match_end)) {
+    return 0;
+  }
+  if (e->match_end == position && e->match_start == position) {
+    if (position == doc_length(&e->document)) {
+      return 0;
+    }
+    return regex_search(&e->regex, &e->document, position + 1,
+                        &e->match_start, &e->match_end);
+  }
+  return 1;
+}
+
+static void editor_regex_search_done(struct Editor *e) {
+  if (!editor_take_regex(e)) {
+    return;
+  }
+  if (editor_regex_find(e, e->position)) {
+    e->mark = e->match_start;
+    e->position = e->match_end;
+  } else {
+    snprintf(e->message, sizeof(e->message), "Failing regexp search");
+  }
+}
+
+static void editor_regex_search(struct Editor *e, int c) {
+  UNUSED(c);
+  editor_prompt(e, "Regexp search: ", editor_regex_search_done);
+}
+
+static const struct KeyMap editor_query_keymap;
+
+static void editor_query_exit(struct Editor *e, int c);
+
+// Move to the next match, or finish if there are no more.
+static void editor_query_next(struct Editor *e, int64_t position) {
+  if (position <= doc_length(&e->document) &&
+      editor_regex_find(e, position)) {
+    e->position = e->match_end;
+    e->mode_keymap = &editor_query_keymap;
+    e->mode_exit = editor_query_exit;
+  } else {
+    editor_query_exit(e, 0);
+  }
+}
+
+static void editor_query_replace(struct Editor *e, int c) {
+  UNUSED(c);
+  int64_t start = e->match_start;
+  e->position = start;
+  editor_erase(e, start, e->match_end - start);
+  editor_insert(e, e->replacement, e->replacement_length);
+  e->replaced += 1;
+
+  // After an empty match, step over a character so we don't find it again.
+  int64_t next = e->position;
+  if (e->match_end == start) {
+    next += 1;
+  }
+  editor_query_next(e, next);
+}
+
+static void editor_query_skip(struct Editor *e, int c) {
+  UNUSED(c);
+  int64_t next = e->match_end;
+  if (next == e->match_start) {
+    next += 1;
+  }
+  editor_query_next(e, next);
+}
+
+// Replace the current match and every one after it. All the matches are
+// found first; then the new text is built in one pass over the document and
+// swapped in whole, so the cost doesn't grow with the number of matches. It
+// is undone in one step.
+static void editor_replace_all(struct Editor *e) {
+  struct Document *doc = &e->document;
+  int64_t length = doc_length(doc);
+  int64_t new_length = length;
+  int64_t *matches = NULL;
+  int64_t count = 0;
+  int64_t capacity = 0;
+  while (1) {
+    if (count * 2 == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      matches = realloc(matches, sizeof(int64_t) * capacity);
+      if (!matches) {
+        die("Cannot grow match list");
+      }
+    }
+    matches[count * 2] = e->match_start;
+    matches[count * 2 + 1] = e->match_end;
+    count += 1;
+    new_length += e->replacement_length - (e->match_end - e->match_start);
+
+    int64_t next = e->match_end;
+    if (next == e->match_start) {
+      next += 1;
+    }
+    if (next > length || !editor_regex_find(e, next)) {
+      break;
+    }
+  }
+
+  char *text = malloc(new_length ? new_length : 1);
+  if (!text) {
+    snprintf(e->message, sizeof(e->message), "Not enough memory to replace");
+    free(matches);
+    return;
+  }
+  int64_t copied = 0;
+  int64_t written = 0;
+  int64_t mark = e->mark;
+  for (int64_t i = 0; i < count; i++) {
+    int64_t start = matches[i * 2];
+    int64_t end = matches[i * 2 + 1];
+    int64_t shift = written - copied;
+    if (e->mark >= copied && e->mark <= start) {
+      mark = e->mark + shift;
+    } else if (e->mark > start && e->mark < end) {
+      mark = start + shift;
+    }
+    doc_read(doc, copied, start - copied, text + written);
+    written += start - copied;
+    memcpy(text + written, e->replacement, e->replacement_length);
+    written += e->replacement_length;
+    copied = end;
+  }
+  if (e->mark >= copied) {
+    mark = e->mark + written - copied;
+  }
+  doc_read(doc, copied, length - copied, text + written);
+
+  int64_t tail = length - copied;
+  if (!undo_replace_all(&e->undo, doc, matches, count, e->replacement,
+                        e->replacement_length, e->position)) {
+    e->replace_lost_undo = 1;
+  }
+  doc_load_memory(doc, doc->kind, text, new_length, new_length);
+  free(matches);
 
-  int last_key;
-  int running;
-};
+  e->position = new_length - tail;
+  e->mark = mark;
+  e->replaced += (int)count;
+}
 
-static void editor_quit(struct Editor *e, int c) {
-  UNUSED(e);
+static void editor_query_replace_rest(struct Editor *e, int c) {
+  editor_replace_all(e);
+  editor_query_exit(e, c);
+}
+
+static void editor_query_exit(struct Editor *e, int c) {
   UNUSED(c);
-  e->running = 0;
+  e->mode_keymap = NULL;
+  snprintf(e->message, sizeof(e->message), "Replaced %d occurrence%s%s",
+           e->replaced, e->replaced == 1 ? "" : "s",
+           e->replace_lost_undo ? ", too many to undo" : "");
 }
 
-static char editor_looking_at(struct Editor *e) {
-  if (e->position >= e->buffer.length) {
-    return 0;
+static void editor_take_replacement(struct Editor *e) {
+  memcpy(e->replacement, e->prompt, e->prompt_length);
+  e->replacement_length = e->prompt_length;
+  e->replaced = 0;
+  e->replace_lost_undo = 0;
+}
+
+static void editor_query_with_done(struct Editor *e) {
+  editor_take_replacement(e);
+  undo_boundary(&e->undo);
+  editor_query_next(e, e->position);
+}
+
+static void editor_query_regex_done(struct Editor *e) {
+  if (editor_take_regex(e)) {
+    editor_prompt(e, "Replace with: ", editor_query_with_done);
   }
+}
 
-  return e->buffer.memory[e->position];
+// Replace matches one at a time, asking about each: y or space to replace,
+// n or DEL to skip, ! to replace the rest, anything else to stop.
+static void editor_query_replace_regex(struct Editor *e, int c) {
+  UNUSED(c);
+  editor_prompt(e, "Query replace regexp: ", editor_query_regex_done);
 }
 
-static int editor_line_start(struct Editor *e, int position) {
-  int line_start = buffer_rfind(&e->buffer, '\n', position - 1);
-  if (line_start < 0) {
-    return 0;
-  } else {
-    return line_start + 1;
+static void editor_replace_with_done(struct Editor *e) {
+  editor_take_replacement(e);
+  if (editor_regex_find(e, e->position)) {
+    editor_replace_all(e);
   }
+  editor_query_exit(e, 0);
 }
 
-static void editor_insert_self(struct Editor *e, int c) {
-  char ch = (char)c;
-  buffer_insert(&e->buffer, e->position, &ch, 1);
-  e->column += 1;
-  e->position += 1;
+static void editor_replace_regex_done(struct Editor *e) {
+  if (editor_take_regex(e)) {
+    editor_prompt(e, "Replace with: ", editor_replace_with_done);
+  }
 }
 
-static void editor_insert_line(struct Editor *e, int c) {
+// Replace every match after the cursor without asking.
+static void editor_replace_regex(struct Editor *e, int c) {
   UNUSED(c);
-  char nl = '\n';
-  buffer_insert(&e->buffer, e->position, &nl, 1);
-  e->column = 0;
-  e->row += 1;
-  e->position += 1;
+  editor_prompt(e, "Replace regexp: ", editor_replace_regex_done);
 }
 
-static void editor_backspace(struct Editor *e, int c) {
+static void editor_undo(struct Editor *e, int c) {
   UNUSED(c);
-  if (e->position > 0) {
-    e->position -= 1;
-    char erased = e->buffer.memory[e->position];
-    buffer_erase(&e->buffer, e->position);
-    if (erased == '\n') {
-      e->row -= 1;
+  undo_undo(&e->undo, &e->document, &e->position);
+}
 
-      int line_start = editor_line_start(e, e->position);
-      e->column = e->position - line_start;
-    } else {
-      e->column -= 1;
-    }
-  }
+static void editor_redo(struct Editor *e, int c) {
+  UNUSED(c);
+  undo_redo(&e->undo, &e->document, &e->position);
 }
 
 static void editor_right_char(struct Editor *e, int c) {
   UNUSED(c);
-  if (e->position < e->buffer.length) {
-    if (editor_looking_at(e) == '\n') {
-      e->row += 1;
-      e->column = 0;
-    } else {
-      e->column += 1;
-    }
+  if (e->position < doc_length(&e->document)) {
     e->position++;
   }
 }
@@ -529,227 +5820,706 @@ static void editor_left_char(struct Editor *e, int c) {
   UNUSED(c);
   if (e->position > 0) {
     e->position--;
-    if (editor_looking_at(e) == '\n') {
-      e->row -= 1;
+  }
+}
 
-      int line_start = editor_line_start(e, e->position);
-      e->column = e->position - line_start;
-    } else {
-      e->column -= 1;
-    }
+// Put the cursor on the given row, as close to the given column of it as
+// the row allows.
+static void editor_goto_row(struct Editor *e, struct EditorRow at,
+                            int64_t column) {
+  int64_t row_start = editor_row_start(e, at);
+  int64_t line_end = editor_line_end(e, at.line);
+  if (row_start + column > line_end) {
+    e->position = line_end;
+  } else {
+    e->position = row_start + column;
   }
 }
 
+// Up and down move by rows on the screen, so through a wrapped line a row
+// at a time.
 static void editor_next_line(struct Editor *e, int c) {
   UNUSED(c);
-
-  // Scan forward to the end of the line; note that we do *not* increment
-  // position here because if we're already at the end of our line we want
-  // our position to be unchanged.
-  int eol = buffer_find(&e->buffer, '\n', e->position);
-  if (eol >= 0) {
-    int line_start = eol + 1;
-    int line_end = buffer_find(&e->buffer, '\n', line_start);
-    if (line_end < 0) {
-      line_end = e->buffer.length;
-    }
-
-    e->row += 1;
-    if (line_start + e->column >= line_end) {
-      e->column = line_end - line_start;
-      e->position = line_end;
-    } else {
-      e->position = line_start + e->column;
-    }
+  struct EditorRow at = editor_row_of(e, e->position);
+  int64_t column = e->position - editor_row_start(e, at);
+  if (editor_step_rows(e, &at, 1)) {
+    editor_goto_row(e, at, column);
   } else {
     // Oh, yeah, we're at the end already.
     // Can't move forward, just be at the end of the buffer.
-    e->position = e->buffer.length;
-
-    int line_start = editor_line_start(e, e->position);
-    e->column = e->position - line_start;
+    e->position = doc_length(&e->document);
   }
 }
 
 static void editor_prev_line(struct Editor *e, int c) {
   UNUSED(c);
-  if (e->row > 0) {
-    e->row -= 1;
-
-    // Figure out the new position and column based on the previous line
-    // position.
-    int line_start = editor_line_start(e, e->position);
-    int prev_line_start = editor_line_start(e, line_start - 1);
-    if (prev_line_start < 0) {
-      prev_line_start = 0;
-    }
-
-    if (prev_line_start + e->column > line_start) {
-      // The cursor would be placed after the end of the line; move us to the
-      // end of the line.
-      e->column = line_start - prev_line_start - 1;
-      e->position = line_start - 1;
-    } else {
-      // Column remains the same, but the position changes.
-      e->position = prev_line_start + e->column;
-    }
+  struct EditorRow at = editor_row_of(e, e->position);
+  int64_t column = e->position - editor_row_start(e, at);
+  if (editor_step_rows(e, &at, -1)) {
+    editor_goto_row(e, at, column);
   }
 }
 
 static void editor_move_beginning_of_line(struct Editor *e, int c) {
   UNUSED(c);
-  e->position = editor_line_start(e, e->position);
-  e->column = 0;
+  e->position = doc_line_start(&e->document, editor_row(e));
 }
 
 static void editor_move_end_of_line(struct Editor *e, int c) {
   UNUSED(c);
-  int line_start = editor_line_start(e, e->position);
-  int eol = buffer_find(&(e->buffer), '\n', line_start);
-  if (eol < 0) {
-    e->position = e->buffer.length;
-  } else {
-    e->position = eol;
+  e->position = editor_line_end(e, editor_row(e));
+}
+
+// Paging moves the view and the cursor together, keeping a couple of lines
+// of the old screen for context.
+static int editor_page_size(struct Editor *e) {
+  int page = e->text_rows - 2;
+  return page < 1 ? 1 : page;
+}
+
+static void editor_page(struct Editor *e, int64_t page) {
+  struct EditorRow top = e->top;
+  if (page < 0 || editor_step_rows(e, &top, page) == page) {
+    editor_step_rows(e, &e->top, page);
   }
-  e->column = e->position - line_start;
+  struct EditorRow at = editor_row_of(e, e->position);
+  int64_t column = e->position - editor_row_start(e, at);
+  editor_step_rows(e, &at, page);
+  editor_goto_row(e, at, column);
+}
+
+static void editor_page_down(struct Editor *e, int c) {
+  UNUSED(c);
+  editor_page(e, editor_page_size(e));
+}
+
+static void editor_page_up(struct Editor *e, int c) {
+  UNUSED(c);
+  editor_page(e, -editor_page_size(e));
+}
+
+static void editor_toggle_wrap(struct Editor *e, int c) {
+  UNUSED(c);
+  e->wrap = !e->wrap;
+}
+
+static void editor_toggle_frame_bytes(struct Editor *e, int c) {
+  UNUSED(c);
+  e->show_frame_bytes = !e->show_frame_bytes;
+}
+
+static void editor_toggle_latency(struct Editor *e, int c) {
+  UNUSED(c);
+  e->show_latency = !e->show_latency;
 }
 
 static void editor_beginning_of_buffer(struct Editor *e, int c) {
   UNUSED(c);
-  e->column = 0;
-  e->row = 0;
   e->position = 0;
 }
 
 static void editor_end_of_buffer(struct Editor *e, int c) {
   UNUSED(c);
+  e->position = doc_length(&e->document);
+}
 
-  // OK... this is the kind of operation that editors usually optimize at some
-  // point in their life.
-  int cursor = editor_line_start(e, e->position);
-  int line_end = buffer_find(&e->buffer, '\n', cursor);
-  while (line_end >= 0) {
-    e->row += 1;
+// The built-in keymaps are constant tables, so starting up doesn't have to
+// build them.
+#define KEYMAP_FN(key, fn) [key] = {key, fn, NULL}
+#define KEYMAP_MAP(key, map) [key] = {key, NULL, map}
 
-    cursor = line_end + 1;
-    line_end = buffer_find(&e->buffer, '\n', cursor);
-  }
+// Bind everything from ' ' to '~'.
+#define KEYMAP_FN_8(c, fn)                                                   \
+  KEYMAP_FN(c, fn), KEYMAP_FN(c + 1, fn), KEYMAP_FN(c + 2, fn),              \
+      KEYMAP_FN(c + 3, fn), KEYMAP_FN(c + 4, fn), KEYMAP_FN(c + 5, fn),      \
+      KEYMAP_FN(c + 6, fn), KEYMAP_FN(c + 7, fn)
+#define KEYMAP_PRINTABLE(fn)                                                 \
+  KEYMAP_FN_8(' ', fn), KEYMAP_FN_8('(', fn), KEYMAP_FN_8('0', fn),          \
+      KEYMAP_FN_8('8', fn), KEYMAP_FN_8('@', fn), KEYMAP_FN_8('H', fn),      \
+      KEYMAP_FN_8('P', fn), KEYMAP_FN_8('X', fn), KEYMAP_FN_8('`', fn),      \
+      KEYMAP_FN_8('h', fn), KEYMAP_FN_8('p', fn), KEYMAP_FN('x', fn),        \
+      KEYMAP_FN('y', fn), KEYMAP_FN('z', fn), KEYMAP_FN('{', fn),            \
+      KEYMAP_FN('|', fn), KEYMAP_FN('}', fn), KEYMAP_FN('~', fn)
 
-  e->position = e->buffer.length;
-  e->column = e->position - cursor;
-}
+static const struct KeyMap editor_control_x_x_keymap = {
+    .direct =
+        {
+            KEYMAP_FN('b', editor_toggle_frame_bytes),
+            KEYMAP_FN('l', editor_toggle_latency),
+            KEYMAP_FN('t', editor_toggle_wrap),
+        },
+};
+
+static const struct KeyMap editor_control_x_keymap = {
+    .direct =
+        {
+            KEYMAP_FN(KEY_CONTROL_C, editor_quit),
+            KEYMAP_FN(KEY_CONTROL_UNDERSCORE, editor_redo),
+            KEYMAP_MAP('x', &editor_control_x_x_keymap),
+        },
+};
+
+// Meta keys are looked up here, as ESC followed by the key.
+static const struct KeyMap editor_escape_keymap = {
+    .direct =
+        {
+            KEYMAP_FN(KEY_CONTROL_S, editor_regex_search),
+            KEYMAP_FN('%', editor_query_replace_regex),
+        },
+};
+
+static const struct KeyMap editor_default_keymap = {
+    .direct =
+        {
+            KEYMAP_PRINTABLE(editor_insert_self),
+
+            KEYMAP_FN(KEY_CONTROL_A, editor_move_beginning_of_line),
+            KEYMAP_FN(KEY_CONTROL_E, editor_move_end_of_line),
 
-static void editor_init_keymap(struct KeyMap *keymap) {
-  for (char c = 1; c < 127; c++) {
-    if (!iscntrl(c)) {
-      keymap_bind_key_fn(keymap, (int)c, editor_insert_self);
+            KEYMAP_FN(KEY_CONTROL_SPACE, editor_set_mark),
+            KEYMAP_FN(KEY_CONTROL_K, editor_kill_line),
+            KEYMAP_FN(KEY_CONTROL_W, editor_kill_region),
+            KEYMAP_FN(KEY_CONTROL_Y, editor_yank),
+            KEYMAP_FN(KEY_CONTROL_S, editor_isearch_forward),
+            KEYMAP_FN(KEY_CONTROL_R, editor_isearch_backward),
+
+            KEYMAP_FN(KEY_CONTROL_M, editor_insert_line),
+            KEYMAP_FN(KEY_CONTROL_UNDERSCORE, editor_undo),
+            KEYMAP_FN(KEY_DEL, editor_backspace),
+            KEYMAP_FN(KEY_UP, editor_prev_line),
+            KEYMAP_FN(KEY_DOWN, editor_next_line),
+            KEYMAP_FN(KEY_LEFT, editor_left_char),
+            KEYMAP_FN(KEY_RIGHT, editor_right_char),
+            KEYMAP_FN(KEY_HOME, editor_beginning_of_buffer),
+            KEYMAP_FN(KEY_END, editor_end_of_buffer),
+            KEYMAP_FN(KEY_PAGE_UP, editor_page_up),
+            KEYMAP_FN(KEY_PAGE_DOWN, editor_page_down),
+
+            KEYMAP_MAP(KEY_CONTROL_X, &editor_control_x_keymap),
+            KEYMAP_MAP(KEY_ESCAPE, &editor_escape_keymap),
+        },
+};
+
+// Keys that mean something during an incremental search. Any other key ends
+// the search and then does what it normally does.
+static const struct KeyMap editor_isearch_keymap = {
+    .direct =
+        {
+            KEYMAP_PRINTABLE(editor_isearch_printing),
+            KEYMAP_FN(KEY_DEL, editor_isearch_delete),
+            KEYMAP_FN(KEY_CONTROL_S, editor_isearch_forward),
+            KEYMAP_FN(KEY_CONTROL_R, editor_isearch_backward),
+            KEYMAP_FN(KEY_CONTROL_G, editor_isearch_abort),
+            KEYMAP_FN(KEY_CONTROL_M, editor_isearch_exit),
+        },
+};
+
+static const struct KeyMap editor_prompt_keymap = {
+    .direct =
+        {
+            KEYMAP_PRINTABLE(editor_prompt_insert),
+            KEYMAP_FN(KEY_DEL, editor_prompt_delete),
+            KEYMAP_FN(KEY_CONTROL_G, editor_prompt_abort),
+            KEYMAP_FN(KEY_CONTROL_M, editor_prompt_accept),
+        },
+};
+
+static const struct KeyMap editor_query_keymap = {
+    .direct =
+        {
+            KEYMAP_FN('y', editor_query_replace),
+            KEYMAP_FN(' ', editor_query_replace),
+            KEYMAP_FN('n', editor_query_skip),
+            KEYMAP_FN(KEY_DEL, editor_query_skip),
+            KEYMAP_FN('!', editor_query_replace_rest),
+        },
+};
+
+// Commands by name, for binding keys from the image.
+static const struct EditorCommand {
+  const char *name;
+  KEY_FN fn;
+} editor_commands[] = {
+    {"self-insert", editor_insert_self},
+    {"newline", editor_insert_line},
+    {"delete-backward-char", editor_backspace},
+    {"forward-char", editor_right_char},
+    {"backward-char", editor_left_char},
+    {"next-line", editor_next_line},
+    {"previous-line", editor_prev_line},
+    {"move-beginning-of-line", editor_move_beginning_of_line},
+    {"move-end-of-line", editor_move_end_of_line},
+    {"page-down", editor_page_down},
+    {"page-up", editor_page_up},
+    {"beginning-of-buffer", editor_beginning_of_buffer},
+    {"end-of-buffer", editor_end_of_buffer},
+    {"toggle-truncate-lines", editor_toggle_wrap},
+    {"toggle-frame-bytes", editor_toggle_frame_bytes},
+    {"toggle-latency", editor_toggle_latency},
+    {"set-mark", editor_set_mark},
+    {"kill-line", editor_kill_line},
+    {"kill-region", editor_kill_region},
+    {"yank", editor_yank},
+    {"isearch-forward", editor_isearch_forward},
+    {"isearch-backward", editor_isearch_backward},
+    {"regexp-search", editor_regex_search},
+    {"query-replace-regexp", editor_query_replace_regex},
+    {"replace-regexp", editor_replace_regex},
+    {"undo", editor_undo},
+    {"redo", editor_redo},
+    {"quit", editor_quit},
+};
+
+static KEY_FN editor_find_command(const char *name) {
+  int count = sizeof(editor_commands) / sizeof(editor_commands[0]);
+  for (int i = 0; i < count; i++) {
+    if (strcmp(editor_commands[i].name, name) == 0) {
+      return editor_commands[i].fn;
     }
   }
-  keymap_bind_key_fn(keymap, KEY_CONTROL_A, editor_move_beginning_of_line);
-  keymap_bind_key_fn(keymap, KEY_CONTROL_E, editor_move_end_of_line);
+  return NULL;
+}
 
-  keymap_bind_key_fn(keymap, KEY_CONTROL_M, editor_insert_line);
-  keymap_bind_key_fn(keymap, KEY_DEL, editor_backspace);
-  keymap_bind_key_fn(keymap, KEY_UP, editor_prev_line);
-  keymap_bind_key_fn(keymap, KEY_DOWN, editor_next_line);
-  keymap_bind_key_fn(keymap, KEY_LEFT, editor_left_char);
-  keymap_bind_key_fn(keymap, KEY_RIGHT, editor_right_char);
-  keymap_bind_key_fn(keymap, KEY_HOME, editor_beginning_of_buffer);
-  keymap_bind_key_fn(keymap, KEY_END, editor_end_of_buffer);
+#define EDITOR_COMMAND_COUNT                                                   \
+  ((int)(sizeof(editor_commands) / sizeof(editor_commands[0])))
 
-  {
-    struct KeyMap *control_x;
-    keymap_init(&control_x, NULL);
-    keymap_bind_key_fn(control_x, KEY_CONTROL_C, editor_quit);
+// Latencies are kept for each named command, then one for keys that ran
+// something without a name (prefix keys, keys in a search, and so on), and
+// one for pastes.
+#define EDITOR_LATENCY_OTHER (EDITOR_COMMAND_COUNT)
+#define EDITOR_LATENCY_PASTE (EDITOR_COMMAND_COUNT + 1)
+#define EDITOR_LATENCY_COUNT (EDITOR_COMMAND_COUNT + 2)
 
-    keymap_bind_key_map(keymap, KEY_CONTROL_X, control_x);
-    keymap_free(&control_x);
+static int editor_latency_command(KEY_FN fn) {
+  for (int i = 0; i < EDITOR_COMMAND_COUNT; i++) {
+    if (editor_commands[i].fn == fn) {
+      return i;
+    }
+  }
+  return EDITOR_LATENCY_OTHER;
+}
+
+static const char *editor_latency_name(int command) {
+  if (command == EDITOR_LATENCY_OTHER) {
+    return "other";
+  }
+  if (command == EDITOR_LATENCY_PASTE) {
+    return "paste";
+  }
+  return editor_commands[command].name;
+}
+
+// Write out the latencies of every command that has run, in microseconds.
+// Returns non-zero if the file can't be written.
+static int editor_dump_latency(struct Editor *editor, const char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    return -1;
+  }
+  fprintf(file, "# command keys p50_us p99_us max_us\n");
+  struct LatencyLog *log = &editor->latency;
+  for (int i = 0; i < log->count; i++) {
+    const struct LatencyHistogram *histogram = log->histograms[i];
+    if (histogram) {
+      fprintf(file, "%s %lld %lld %lld %lld\n", editor_latency_name(i),
+              (long long)histogram->count,
+              (long long)latency_percentile(histogram, 500),
+              (long long)latency_percentile(histogram, 990),
+              (long long)histogram->max);
+    }
   }
+  return fclose(file) == 0 ? 0 : -1;
+}
+
+static const struct KeyMap *editor_root_keymap(struct Editor *editor) {
+  return editor->keymap ? editor->keymap : &editor_default_keymap;
 }
 
+// How much the undo log may hold, unless the image says otherwise.
+#define DEFAULT_UNDO_LIMIT (16 << 20)
+
 static void editor_init(struct Editor *editor) {
-  editor->row = 0;
-  editor->column = 0;
   editor->position = 0;
+  editor->top.line = editor->top.row = 0;
+  editor->text_rows = 1;
+  editor->text_columns = 0;
+  editor->wrap = 0;
+  editor->show_frame_bytes = 0;
+  latency_init(&editor->latency, EDITOR_LATENCY_COUNT);
+  editor->show_latency = 0;
+  editor->drawn_top = editor->top;
   editor->running = 1;
 
-  keymap_init(&editor->default_keymap, NULL);
-  editor_init_keymap(editor->default_keymap);
-  editor->current_keymap = keymap_ref(editor->default_keymap);
+  editor->keymap = NULL;
+  editor->current_keymap = &editor_default_keymap;
 
-  buffer_init(&editor->buffer);
+  doc_init(&editor->document, DOCUMENT_GAP);
+  undo_init(&editor->undo, DEFAULT_UNDO_LIMIT);
+  editor->last_command = NULL;
+  editor->mark = -1;
+  editor->kill_count = 0;
+  editor->kill_newest = 0;
+  editor->mode_keymap = NULL;
+  editor->mode_exit = NULL;
+  editor->message[0] = 0;
+  memset(&editor->regex, 0, sizeof(editor->regex));
+  editor->regex_length = 0;
   buffer_init(&editor->status_buffer);
 }
 
 static void editor_free(struct Editor *editor) {
-  buffer_free(&editor->buffer);
-  keymap_free(&editor->default_keymap);
-  keymap_free(&editor->current_keymap);
+  doc_free(&editor->document);
+  undo_free(&editor->undo);
+  regex_free(&editor->regex);
+  for (int i = 0; i < editor->kill_count; i++) {
+    buffer_free(&editor->kill_ring[i]);
+  }
+  keymap_free(&editor->keymap);
+  latency_free(&editor->latency);
+}
+
+// How many lines to keep between the cursor and the top or bottom of the
+// screen, where there are lines to show there.
+#define EDITOR_SCROLL_MARGIN (3)
+
+// Pick the top row so that the cursor is on the screen and, where
+// possible, not right up against its edges.
+static struct EditorRow editor_scroll_to_cursor(struct Editor *editor,
+                                                struct EditorRow cursor) {
+  int text_rows = editor->text_rows;
+  int64_t margin = EDITOR_SCROLL_MARGIN;
+  if (margin > (text_rows - 1) / 2) {
+    margin = (text_rows - 1) / 2;
+  }
+
+  struct EditorRow end = cursor;
+  int64_t below = editor_step_rows(editor, &end, margin);
+
+  // The top line may have been edited, or rewrapped, since the last frame.
+  struct EditorRow top = editor->top;
+  int64_t last_line =
+      doc_line_of(&editor->document, doc_length(&editor->document));
+  if (top.line > last_line) {
+    top.line = last_line;
+  }
+  int64_t top_rows = editor_line_rows(editor, top.line);
+  if (top.row >= top_rows) {
+    top.row = top_rows - 1;
+  }
+
+  struct EditorRow above = cursor;
+  editor_step_rows(editor, &above, -margin);
+  if (editor_row_before(above, top)) {
+    top = above;
+  }
+  if (editor_rows_between(editor, top, cursor, text_rows) + below >=
+      text_rows) {
+    top = cursor;
+    editor_step_rows(editor, &top, -(text_rows - 1 - below));
+  }
+  return top;
+}
+
+// Draw a range of the document a chunk at a time.
+static void editor_draw_text(struct Editor *editor, struct Terminal *terminal,
+                             int64_t position, int64_t length) {
+  while (length > 0) {
+    int64_t start;
+    int64_t chunk_length;
+    const char *chunk =
+        doc_chunk(&editor->document, position, &start, &chunk_length);
+    int64_t count = start + chunk_length - position;
+    if (count > length) {
+      count = length;
+    }
+    term_write(terminal, chunk + (position - start), (int)count);
+    position += count;
+    length -= count;
+  }
 }
 
 static void editor_render(struct Editor *editor, struct Terminal *terminal) {
+  // If the view moves by less than a screenful, let the terminal shift what
+  // it already has.
+  int text_rows = terminal->rows - 1;
+  editor->text_rows = text_rows;
+  editor->text_columns = terminal->columns;
+  struct EditorRow cursor = editor_row_of(editor, editor->position);
+  struct EditorRow top = editor_scroll_to_cursor(editor, cursor);
+  int64_t scroll;
+  if (editor_row_before(top, editor->drawn_top)) {
+    scroll = -editor_rows_between(editor, top, editor->drawn_top, text_rows);
+  } else {
+    scroll = editor_rows_between(editor, editor->drawn_top, top, text_rows);
+  }
+  if (scroll > -text_rows && scroll < text_rows) {
+    term_scroll(terminal, 0, text_rows - 1, (int)scroll);
+  }
+  editor->top = top;
+  editor->drawn_top = top;
+
   term_clear(terminal);
 
+  // Start at the top row, which the line index finds without reading any
+  // text, and draw one row of the screen at a time. However long the lines
+  // are, only the text that ends up on the screen gets read.
+  int64_t width = editor_wrap_width(editor);
   int row = 0;
-  int col = 0;
-  char *src = editor->buffer.memory;
-  for (int i = 0; i < editor->buffer.length; i++) {
-    if (src[i] == '\n') {
-      term_write(terminal, "\r\n", 2);
-      row += 1;
-      col = 0;
-      if (row >= terminal->rows - 1) {
-        break;
-      }
-    } else if (col < terminal->columns) {
-      term_write(terminal, src + i, 1);
-      col += 1;
+  struct EditorRow at = top;
+  while (row < text_rows) {
+    int64_t start = editor_row_start(editor, at);
+    int64_t visible = editor_line_end(editor, at.line) - start;
+    if (visible > width) {
+      visible = width;
+    }
+    if (visible > terminal->columns) {
+      visible = terminal->columns;
+    }
+    editor_draw_text(editor, terminal, start, visible);
+    term_write(terminal, "\r\n", 2);
+    row += 1;
+    if (!editor_step_rows(editor, &at, 1)) {
+      break;
     }
   }
-  term_write(terminal, "\r\n", 2);
-  row += 1;
   for (; row < terminal->rows - 1; row++) {
     term_write(terminal, "~\r\n", 3);
   }
 
   // Status line.
   {
+    term_move(terminal, terminal->rows - 1, 0);
     buffer_clear(&editor->status_buffer);
-    const char *message = "Hello world, I am ready for you. ";
-    buffer_append(&editor->status_buffer, message, strlen(message));
-    buffer_append_int(&editor->status_buffer, editor->last_key);
+    if (editor->mode_keymap == &editor_prompt_keymap) {
+      buffer_append(&editor->status_buffer, editor->prompt_label,
+                    strlen(editor->prompt_label));
+      buffer_append(&editor->status_buffer, editor->prompt,
+                    editor->prompt_length);
+    } else if (editor->mode_keymap == &editor_query_keymap) {
+      const char *message = "Query replacing ";
+      buffer_append(&editor->status_buffer, message, strlen(message));
+      buffer_append(&editor->status_buffer, editor->regex_source,
+                    editor->regex_length);
+      buffer_append(&editor->status_buffer, " with ", 6);
+      buffer_append(&editor->status_buffer, editor->replacement,
+                    editor->replacement_length);
+      message = ": (y, n, !, q)";
+      buffer_append(&editor->status_buffer, message, strlen(message));
+    } else if (editor->message[0]) {
+      buffer_append(&editor->status_buffer, editor->message,
+                    strlen(editor->message));
+    } else if (editor_searching(editor)) {
+      const char *message = "I-search: ";
+      if (!editor->search_forward) {
+        message = "I-search backward: ";
+      }
+      if (editor->search_matches[editor->search_length] < 0) {
+        buffer_append(&editor->status_buffer, "Failing ", 8);
+      }
+      buffer_append(&editor->status_buffer, message, strlen(message));
+      buffer_append(&editor->status_buffer, editor->search,
+                    editor->search_length);
+    } else if (editor->show_latency && editor->latency.last >= 0) {
+      // Like frame bytes, this is as of the last frame.
+      char message[EDITOR_MESSAGE_MAX];
+      int last = editor->latency.last;
+      const struct LatencyHistogram *histogram =
+          editor->latency.histograms[last];
+      snprintf(message, sizeof(message),
+               "%s: p50 %lldus, p99 %lldus, max %lldus over %lld keys",
+               editor_latency_name(last),
+               (long long)latency_percentile(histogram, 500),
+               (long long)latency_percentile(histogram, 990),
+               (long long)histogram->max, (long long)histogram->count);
+      buffer_append(&editor->status_buffer, message, strlen(message));
+    } else if (editor->show_frame_bytes) {
+      // The frame being drawn isn't counted until it has been sent.
+      char message[EDITOR_MESSAGE_MAX];
+      int64_t frames = terminal->frames ? terminal->frames : 1;
+      snprintf(message, sizeof(message),
+               "Last frame %d bytes, %lld on average over %lld frames",
+               terminal->frame_bytes,
+               (long long)(terminal->total_bytes / frames),
+               (long long)terminal->frames);
+      buffer_append(&editor->status_buffer, message, strlen(message));
+    } else {
+      const char *message = "Hello world, I am ready for you. ";
+      buffer_append(&editor->status_buffer, message, strlen(message));
+      buffer_append_int(&editor->status_buffer, editor->last_key);
+    }
     term_write(terminal, editor->status_buffer.memory,
                editor->status_buffer.length);
   }
 
   // Put the cursor where it belongs.
-  term_set_cursor(terminal, editor->row, editor->column);
+  term_set_cursor(terminal,
+                  (int)editor_rows_between(editor, top, cursor, text_rows),
+                  (int)(editor->position - editor_row_start(editor, cursor)));
 }
 
-static void editor_handle_key(struct Editor *editor, int c) {
+// Returns the command the key ran, or NULL if it didn't run one.
+static KEY_FN editor_handle_key(struct Editor *editor, int c) {
   editor->last_key = c; // HACKHACK
-  struct KeyBinding *binding = keymap_lookup(editor->current_keymap, c);
+  editor->message[0] = 0;
+  if (editor->mode_keymap &&
+      editor->current_keymap == editor_root_keymap(editor)) {
+    const struct KeyBinding *binding = keymap_lookup(editor->mode_keymap, c);
+    if (binding) {
+      binding->fn(editor, c);
+      editor->last_command = binding->fn;
+      return binding->fn;
+    }
+    if (!editor->mode_exit) {
+      return NULL;
+    }
+    editor->mode_exit(editor, c);
+  }
+
+  // M-x is ESC x, as far as the keymaps are concerned.
+  if ((c & KEY_MOD_ALT) && (c & ~KEY_MOD_ALT) < KEYMAP_DIRECT_KEYS) {
+    editor_handle_key(editor, KEY_ESCAPE);
+    c &= ~KEY_MOD_ALT;
+  }
+
+  const struct KeyBinding *binding =
+      keymap_lookup(editor->current_keymap, c);
   if (binding) {
     if (binding->map) {
-      keymap_set(&editor->current_keymap, binding->map);
+      editor->current_keymap = binding->map;
     } else {
+      // Typing and deleting are undone a run at a time; anything else
+      // starts a new transaction.
+      if (binding->fn != editor->last_command ||
+          (binding->fn != editor_insert_self &&
+           binding->fn != editor_backspace)) {
+        undo_boundary(&editor->undo);
+      }
       binding->fn(editor, c);
-      keymap_set(&editor->current_keymap, editor->default_keymap);
+      editor->last_command = binding->fn;
+      editor->current_keymap = editor_root_keymap(editor);
+      return binding->fn;
     }
   } else {
     // NOT BOUND, JUST GIVE UP.
-    keymap_set(&editor->current_keymap, editor->default_keymap);
+    editor->current_keymap = editor_root_keymap(editor);
+  }
+  return NULL;
+}
+
+// Pasted text skips the keymaps. At a prompt or in a search it goes on the
+// end of what has been typed; any other mode is left first, as for a key it
+// doesn't bind, since the paste moves the text the mode was looking at.
+static void editor_paste(struct Editor *editor, const char *data,
+                         int64_t length) {
+  editor->message[0] = 0;
+  editor->current_keymap = editor_root_keymap(editor);
+  if (editor->mode_keymap == &editor_prompt_keymap) {
+    for (int64_t i = 0; i < length; i++) {
+      editor_prompt_insert(editor, (unsigned char)data[i]);
+    }
+    return;
+  }
+  if (editor_searching(editor)) {
+    for (int64_t i = 0; i < length; i++) {
+      editor_isearch_printing(editor, (unsigned char)data[i]);
+    }
+    return;
+  }
+  if (editor->mode_keymap) {
+    if (editor->mode_exit) {
+      editor->mode_exit(editor, KEY_PASTE);
+    }
+    editor->mode_keymap = NULL;
+  }
+  editor_insert_text(editor, data, length);
+}
+
+// Read a key and run it, remembering when it was read so that the frame
+// that shows it can be timed.
+static void editor_run_key(struct Editor *editor, struct Terminal *terminal) {
+  int c = term_read(terminal);
+  if (c == KEY_NONE) {
+    // A reply to a query, or a sequence we don't know: not a key, so it
+    // mustn't end a search or a prompt, or clear the message.
+    return;
+  }
+  int command = EDITOR_LATENCY_PASTE;
+  if (c == KEY_PASTE) {
+    editor_paste(editor, terminal->paste.memory, terminal->paste.length);
+  } else {
+    command = editor_latency_command(editor_handle_key(editor, c));
   }
+  latency_add(&editor->latency, command, terminal->read_us);
+}
+
+// Run a headless terminal's keys one at a time, with a frame after each, and
+// print the last screen and what the frames cost. Every screen goes into a
+// hash, so two builds can be checked for drawing the same things, and is
+// checked against what term_draw meant to draw.
+static void editor_replay(struct Editor *editor, struct Terminal *terminal) {
+  struct TermScreen *screen = terminal->screen;
+  int cells = terminal->rows * terminal->columns;
+  int64_t render_us = 0;
+  int64_t wrong = 0;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (;;) {
+    int64_t start_us = clock_us();
+    editor_render(editor, terminal);
+    render_us += clock_us() - start_us;
+    term_draw(terminal);
+    latency_frame(&editor->latency, clock_us());
+
+    int cursor_row = terminal->cursor_row;
+    int cursor_column = terminal->cursor_column;
+    if (cursor_row >= terminal->rows) {
+      cursor_row = terminal->rows - 1;
+    }
+    if (cursor_column >= terminal->columns) {
+      cursor_column = terminal->columns - 1;
+    }
+    if (memcmp(screen->cells, terminal->back, cells) ||
+        screen->row != cursor_row || screen->column != cursor_column) {
+      wrong += 1;
+    }
+    hash = term_screen_hash(screen, hash);
+
+    if (!editor->running || !term_poll(terminal, 0)) {
+      break;
+    }
+    editor_run_key(editor, terminal);
+  }
+
+  for (int row = 0; row < screen->rows; row++) {
+    const char *line = screen->cells + row * screen->columns;
+    int length = screen->columns;
+    while (length > 0 && line[length - 1] == ' ') {
+      length -= 1;
+    }
+    printf("%.*s\n", length, line);
+  }
+  int64_t frames = terminal->frames;
+  printf("%lld frames, %lld bytes, %lld bytes per frame\n", (long long)frames,
+         (long long)screen->bytes, (long long)(terminal->total_bytes / frames));
+  printf("%lld us rendering and %lld us drawing per frame\n",
+         (long long)(render_us / frames),
+         (long long)(terminal->total_us / frames));
+  printf("%lld wrong screens, %lld unknown sequences, hash %016llx\n",
+         (long long)wrong, (long long)screen->unknown,
+         (unsigned long long)hash);
 }
 
 struct Image {
   sqlite3 *db;
   sqlite3_stmt *get_document;
+  sqlite3_stmt *get_property;
+  sqlite3_stmt *get_bindings;
 };
 
 static int image_open(struct Image *image, const char *file) {
   image->db = NULL;
   image->get_document = NULL;
+  image->get_property = NULL;
+  image->get_bindings = NULL;
   int rc = sqlite3_open(file, &image->db);
   if (rc) {
     return rc;
@@ -789,6 +6559,24 @@ static int image_open(struct Image *image, const char *file) {
     die("prepare get_document");
   }
 
+  rc = sqlite3_prepare_v2(image->db,
+                          "SELECT value "
+                          "FROM Properties "
+                          "WHERE name=?",
+                          -1, &image->get_property, NULL);
+  if (rc) {
+    die("prepare get_property");
+  }
+
+  rc = sqlite3_prepare_v2(image->db,
+                          "SELECT name, value "
+                          "FROM Properties "
+                          "WHERE name GLOB 'bind.*'",
+                          -1, &image->get_bindings, NULL);
+  if (rc) {
+    die("prepare get_bindings");
+  }
+
   return 0;
 }
 
@@ -828,20 +6616,159 @@ static int image_get_document(struct Image *image, struct Buffer *out,
   return 0; // OK.
 }
 
+#define QUERY_PARAM_GET_PROPERTY_NAME (1)
+#define QUERY_RESULT_GET_PROPERTY_VALUE (0)
+
+// Fetch a property as a NUL-terminated string.
+static int image_get_property(struct Image *image, struct Buffer *out,
+                              const char *name) {
+  int rc;
+  rc = sqlite3_reset(image->get_property);
+  if (rc) {
+    die("get_property -> reset");
+  }
+
+  rc = sqlite3_bind_text(image->get_property, QUERY_PARAM_GET_PROPERTY_NAME,
+                         name, -1, NULL);
+  if (rc) {
+    die("get_property -> bind name");
+  }
+
+  rc = sqlite3_step(image->get_property);
+  if (rc == SQLITE_DONE) {
+    return 2; // Not found.
+  }
+  if (rc != SQLITE_ROW) {
+    die("get_property -> step");
+  }
+
+  int value_length = sqlite3_column_bytes(image->get_property,
+                                          QUERY_RESULT_GET_PROPERTY_VALUE);
+  const char *value = (const char *)sqlite3_column_text(
+      image->get_property, QUERY_RESULT_GET_PROPERTY_VALUE);
+
+  buffer_clear(out);
+  buffer_append(out, value, value_length);
+  buffer_append(out, "", 1);
+  return 0; // OK.
+}
+
+#define QUERY_RESULT_GET_BINDINGS_NAME (0)
+#define QUERY_RESULT_GET_BINDINGS_VALUE (1)
+
+// Step through the key bindings in the image: properties named
+// "bind.<key code>" whose value is the name of a command. Returns 0 for each
+// binding and 2 once they run out. Names whose key code isn't a positive
+// number, like "bind.foo", are skipped.
+static int image_next_binding(struct Image *image, int *key,
+                              struct Buffer *command) {
+  for (;;) {
+    int rc = sqlite3_step(image->get_bindings);
+    if (rc == SQLITE_DONE) {
+      sqlite3_reset(image->get_bindings);
+      return 2;
+    }
+    if (rc != SQLITE_ROW) {
+      die("get_bindings -> step");
+    }
+
+    const char *name = (const char *)sqlite3_column_text(
+        image->get_bindings, QUERY_RESULT_GET_BINDINGS_NAME);
+    const char *code = name + strlen("bind.");
+    char *end;
+    errno = 0;
+    long number = strtol(code, &end, 10);
+    if (end != code && *end == '\0' && errno == 0 && number > 0 &&
+        number <= INT_MAX) {
+      *key = (int)number;
+      break;
+    }
+  }
+
+  int value_length = sqlite3_column_bytes(image->get_bindings,
+                                          QUERY_RESULT_GET_BINDINGS_VALUE);
+  const char *value = (const char *)sqlite3_column_text(
+      image->get_bindings, QUERY_RESULT_GET_BINDINGS_VALUE);
+
+  buffer_clear(command);
+  buffer_append(command, value, value_length);
+  buffer_append(command, "", 1);
+  return 0;
+}
+
 static void image_close(struct Image *image) {
   if (image->get_document) {
     sqlite3_finalize(image->get_document);
     image->get_document = NULL;
   }
+  if (image->get_property) {
+    sqlite3_finalize(image->get_property);
+    image->get_property = NULL;
+  }
+  if (image->get_bindings) {
+    sqlite3_finalize(image->get_bindings);
+    image->get_bindings = NULL;
+  }
   if (image->db) {
     sqlite3_close(image->db);
     image->db = NULL;
   }
 }
 
-int main() {
+// Bindings in the image go in an overlay on the default keymap, which is
+// only made if there are any.
+static void editor_load_bindings(struct Editor *editor, struct Image *image) {
+  int key;
+  struct Buffer command;
+  buffer_init(&command);
+  while (image_next_binding(image, &key, &command) == 0) {
+    KEY_FN fn = editor_find_command(command.memory);
+    if (!fn) {
+      continue;
+    }
+    if (!editor->keymap) {
+      keymap_init(&editor->keymap, &editor_default_keymap);
+    }
+    keymap_bind_key_fn(editor->keymap, key, fn);
+  }
+  buffer_free(&command);
+  editor->current_keymap = editor_root_keymap(editor);
+}
+
+#define DEFAULT_MAX_FPS (60)
+
+int main(int argc, char **argv) {
+  if (argc >= 2 && strcmp(argv[1], "--bench") == 0) {
+    return text_bench((argc >= 3 ? atoll(argv[2]) : 256) << 20) ? 1 : 0;
+  }
+  if (argc >= 4 && strcmp(argv[1], "--bench-regex") == 0) {
+    regex_bench(argv[2], argv + 3, argc - 3);
+    return 0;
+  }
+  if (argc >= 2 && strcmp(argv[1], "--check-regex") == 0) {
+    return regex_check() ? 1 : 0;
+  }
+
+  // "nib --replay KEYS [ROWS COLUMNS]" runs the keys in the file KEYS on a
+  // screen in memory rather than the terminal; see editor_replay.
+  int replay = argc >= 3 && strcmp(argv[1], "--replay") == 0;
   struct Terminal terminal;
-  term_init(&terminal, STDIN_FILENO, STDOUT_FILENO);
+  if (replay) {
+    int rows = argc >= 5 ? atoi(argv[3]) : 24;
+    int columns = argc >= 5 ? atoi(argv[4]) : 80;
+    if (rows < 2 || columns < 1) {
+      die("Bad screen size");
+    }
+    struct Buffer keys;
+    buffer_init(&keys);
+    if (buffer_append_file(&keys, argv[2])) {
+      die(argv[2]);
+    }
+    term_init_headless(&terminal, rows, columns, keys.memory, keys.length);
+    buffer_free(&keys);
+  } else {
+    term_init(&terminal, STDIN_FILENO, STDOUT_FILENO);
+  }
 
   struct Image image;
   if (image_open(&image, "core.nib")) {
@@ -850,22 +6777,117 @@ int main() {
 
   struct Editor editor;
   editor_init(&editor);
+  editor_load_bindings(&editor, &image);
 
   {
     const char *init_name = "init";
-    image_get_document(&image, &editor.buffer, init_name, strlen(init_name));
+    struct Buffer text;
+    buffer_init(&text);
+    if (image_get_document(&image, &text, init_name, strlen(init_name)) == 0) {
+      doc_load(&editor.document, doc_kind_for(text.length), &text);
+    }
+    buffer_free(&text);
+  }
+
+  // Frames are capped at max-fps (0 for no cap).
+  int frame_interval = 0;
+  {
+    int max_fps = DEFAULT_MAX_FPS;
+    struct Buffer value;
+    buffer_init(&value);
+    if (image_get_property(&image, &value, "max-fps") == 0) {
+      max_fps = atoi(value.memory);
+    }
+    buffer_free(&value);
+    if (max_fps > 0) {
+      frame_interval = 1000 / max_fps;
+    }
+  }
+
+  {
+    struct Buffer value;
+    buffer_init(&value);
+    if (image_get_property(&image, &value, "undo-limit") == 0) {
+      editor.undo.limit = atoll(value.memory);
+    }
+    buffer_free(&value);
+  }
+
+  // Long lines are cut off at the edge of the screen unless wrap-lines is
+  // set.
+  {
+    struct Buffer value;
+    buffer_init(&value);
+    if (image_get_property(&image, &value, "wrap-lines") == 0) {
+      editor.wrap = atoi(value.memory) != 0;
+    }
+    buffer_free(&value);
+  }
+
+  // Set terminal-repeat to 1 or 0 for terminals that do or don't
+  // understand REP, whatever they say they are.
+  {
+    struct Buffer value;
+    buffer_init(&value);
+    if (image_get_property(&image, &value, "terminal-repeat") == 0) {
+      terminal.repeat = atoi(value.memory) != 0;
+      terminal.repeat_settled = 1;
+    }
+    buffer_free(&value);
+  }
+
+  // If latency-file is set, the time keys took to show is written there
+  // at exit.
+  struct Buffer latency_file;
+  buffer_init(&latency_file);
+  if (image_get_property(&image, &latency_file, "latency-file") != 0) {
+    buffer_clear(&latency_file);
   }
 
-  while (editor.running) {
-    editor_render(&editor, &terminal);
-    term_draw(&terminal);
+  // Run every key that is already waiting before drawing, so that a paste
+  // or a burst of key repeats costs one frame instead of one per key.
+  //
+  // Resizes wait for the next frame in the same way, so dragging the window
+  // edge lays the text out once per frame rather than once per SIGWINCH.
+  int64_t last_frame = 0;
+  int dirty = 1;
+  if (replay) {
+    editor_replay(&editor, &terminal);
+  }
+  while (editor.running && !replay) {
+    if (term_resize(&terminal)) {
+      dirty = 1;
+    }
+    if (dirty) {
+      int64_t wait = last_frame + frame_interval - clock_ms();
+      if (wait <= 0 || !term_poll(&terminal, (int)wait)) {
+        if (terminal.resize_pending) {
+          continue;
+        }
+        editor_render(&editor, &terminal);
+        term_draw(&terminal);
+        latency_frame(&editor.latency, clock_us());
+        last_frame = clock_ms();
+        dirty = 0;
+        continue;
+      }
+    } else if (!term_poll(&terminal, -1)) {
+      continue;
+    }
 
-    int c = term_read(&terminal);
-    editor_handle_key(&editor, c);
+    do {
+      editor_run_key(&editor, &terminal);
+    } while (editor.running && term_poll(&terminal, 0));
+    dirty = 1;
   }
 
+  term_free(&terminal);
+  if (latency_file.length &&
+      editor_dump_latency(&editor, latency_file.memory) != 0) {
+    perror(latency_file.memory);
+  }
+  buffer_free(&latency_file);
   editor_free(&editor);
   image_close(&image);
-  term_free(&terminal);
   return 0;
 }